@@ -0,0 +1,103 @@
+#include <ctime>
+#include "aging.h"
+
+using namespace std;
+
+
+u_int32_t g_coarse_time = 0;
+
+
+void coarse_clock_update()
+{
+    __atomic_store_n(&g_coarse_time, (u_int32_t) time(NULL), __ATOMIC_RELAXED);
+}
+
+
+
+TimingWheel::TimingWheel()
+{
+    this->now = coarse_time();
+    this->count = 0;
+}
+
+
+void TimingWheel::add(u_int64_t id, u_int32_t expires)
+{
+    WheelTimer timer;
+    int level;
+
+    if ((int32_t) (expires - this->now) <= 0) {
+        // Already expired - fire on next tick
+        expires = this->now + 1;
+    }
+
+    timer.expires = expires;
+    timer.id = id;
+
+    // Pick the lowest level whose range covers the timeout
+    for (level=0; level < WHEEL_LEVELS - 1; level++) {
+        int shift = level * WHEEL_SLOT_BITS;
+        if ((expires >> shift) - (this->now >> shift) < WHEEL_SLOTS) {
+            break;
+        }
+    }
+
+    int shift = level * WHEEL_SLOT_BITS;
+    if ((expires >> shift) - (this->now >> shift) >= WHEEL_SLOTS) {
+        // Out of range of the top level - wait in the farthest slot, timer
+        // is cascaded early and added again
+        expires = ((this->now >> shift) + WHEEL_SLOTS - 1) << shift;
+    }
+
+    this->slots[level][(expires >> shift) & WHEEL_SLOT_MASK].push_back(timer);
+    this->count++;
+}
+
+
+// Move timers from slot of the level which is current now to lower levels
+void TimingWheel::cascade(int level)
+{
+    vector<WheelTimer> timers;
+    int shift = level * WHEEL_SLOT_BITS;
+
+    timers.swap(this->slots[level][(this->now >> shift) & WHEEL_SLOT_MASK]);
+    this->count -= timers.size();
+    for (size_t i=0; i < timers.size(); i++) {
+        if (timers[i].expires == this->now) {
+            // Due right now - level 0 slot of this tick is processed after cascading
+            this->slots[0][this->now & WHEEL_SLOT_MASK].push_back(timers[i]);
+            this->count++;
+        } else {
+            add(timers[i].id, timers[i].expires);
+        }
+    }
+}
+
+
+void TimingWheel::advance(u_int32_t now, vector<WheelTimer> &expired)
+{
+    while ((int32_t) (now - this->now) > 0) {
+        this->now++;
+
+        for (int level=1; level < WHEEL_LEVELS; level++) {
+            if (this->now & ((1 << (level * WHEEL_SLOT_BITS)) - 1)) {
+                break;
+            }
+            cascade(level);
+        }
+
+        vector<WheelTimer> &slot = this->slots[0][this->now & WHEEL_SLOT_MASK];
+        if (slot.empty()) {
+            continue;
+        }
+        this->count -= slot.size();
+        expired.insert(expired.end(), slot.begin(), slot.end());
+        slot.clear();
+    }
+}
+
+
+size_t TimingWheel::size()
+{
+    return this->count;
+}
@@ -0,0 +1,72 @@
+#ifndef __SWITCH_AGING_H__
+#define __SWITCH_AGING_H__
+
+#include <vector>
+#include <time.h>
+#include <sys/types.h>
+
+using namespace std;
+
+#define WHEEL_LEVELS        3
+#define WHEEL_SLOT_BITS     6
+#define WHEEL_SLOTS         (1 << WHEEL_SLOT_BITS)  // level 0: 1 s, level 1: 64 s, level 2: 4096 s per slot
+#define WHEEL_SLOT_MASK     (WHEEL_SLOTS - 1)
+
+
+// Coarse clock (seconds), published by the aging thread so the data path
+// doesn't have to call time() for every frame
+extern u_int32_t g_coarse_time;
+
+static inline u_int32_t coarse_time()
+{
+    return __atomic_load_n(&g_coarse_time, __ATOMIC_RELAXED);
+}
+
+void coarse_clock_update();
+
+
+// Precise monotonic time in ns (for latency bounds, not for aging)
+static inline u_int64_t mono_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u_int64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+// Wall clock time in ns, comparable with kernel receive timestamps
+static inline u_int64_t real_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (u_int64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+class WheelTimer {
+    public:
+        u_int32_t expires;
+        u_int64_t id;  // meaning is up to the owner of the wheel
+};
+
+
+// Hierarchical timing wheel with one second resolution. Timers are not
+// cancelled, owners check on expiry whether the timer is still valid
+// (and add it again if the entry was refreshed meanwhile).
+// Not thread safe - the owner serializes access.
+class TimingWheel {
+    private:
+        vector<WheelTimer> slots[WHEEL_LEVELS][WHEEL_SLOTS];
+        u_int32_t now;    // time the wheel has been advanced to
+        size_t count;
+
+        void cascade(int level);
+
+    public:
+        TimingWheel();
+        void add(u_int64_t id, u_int32_t expires);
+        void advance(u_int32_t now, vector<WheelTimer> &expired); // append all timers with expires <= now
+        size_t size();
+};
+
+#endif /* __SWITCH_AGING_H__ */
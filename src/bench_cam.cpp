@@ -0,0 +1,151 @@
+/*
+ * CAM table microbenchmark
+ * Compares the packed hash CamTable with the former string keyed
+ * std::map implementation using the per-frame access pattern of handler()
+ * (update by source address + lookup by destination address).
+ */
+
+#include <map>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <time.h>
+#include "camtable.h"
+
+using namespace std;
+
+#define BENCH_PORTS     8
+#define BENCH_FRAMES    (4 * 1000 * 1000)
+
+
+// Former CAM engine (std::map keyed by MacAddress::str())
+class LegacyRecord {
+    public:
+        MacAddress mac;
+        time_t last_used;
+        Port *port;
+};
+
+class LegacyCamTable {
+    private:
+        pthread_mutex_t mutex;
+        map<string, LegacyRecord*> records;
+
+    public:
+        LegacyCamTable() { pthread_mutex_init(&(this->mutex), NULL); }
+        ~LegacyCamTable()
+        {
+            map<string, LegacyRecord*>::iterator it;
+            for (it=this->records.begin(); it != this->records.end(); it++) {
+                delete it->second;
+            }
+            pthread_mutex_destroy(&(this->mutex));
+        }
+
+        void update(MacAddress &mac, Port *port)
+        {
+            map<string, LegacyRecord*>::iterator it;
+            pthread_mutex_lock(&(this->mutex));
+            it = this->records.find(mac.str());
+            if (it == this->records.end()) {
+                LegacyRecord *rec = new LegacyRecord;
+                memcpy(rec->mac.mac, mac.mac, ETH_ALEN);
+                rec->port = port;
+                rec->last_used = time(NULL);
+                this->records[mac.str()] = rec;
+            } else {
+                it->second->last_used = time(NULL);
+            }
+            pthread_mutex_unlock(&(this->mutex));
+        }
+
+        Port *get_port(MacAddress &mac)
+        {
+            Port *ret = NULL;
+            map<string, LegacyRecord*>::iterator it;
+            pthread_mutex_lock(&(this->mutex));
+            it = this->records.find(mac.str());
+            if (it != this->records.end()) {
+                ret = it->second->port;
+            }
+            pthread_mutex_unlock(&(this->mutex));
+            return ret;
+        }
+};
+
+
+static double now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void report(const char *name, size_t hosts, double elapsed, size_t hits)
+{
+    printf("%-8s hosts=%-7zu %8.2f Mframes/s  %6.1f ns/frame  (hits %zu)\n", name, hosts,
+           BENCH_FRAMES / elapsed / 1e6, elapsed * 1e9 / BENCH_FRAMES, hits);
+}
+
+
+int main()
+{
+    coarse_clock_update();
+
+    vector<Port*> ports;
+    for (unsigned int i=0; i < BENCH_PORTS; i++) {
+        Port *port = new Port();
+        port->index = i;
+        ports.push_back(port);
+    }
+
+    size_t host_counts[] = { 64, 4096, 32768 };
+    for (size_t h=0; h < sizeof(host_counts) / sizeof(host_counts[0]); h++) {
+        size_t hosts = host_counts[h];
+        vector<MacAddress> macs(hosts);
+        srand(1);
+        for (size_t i=0; i < hosts; i++) {
+            for (int j=0; j < ETH_ALEN; j++) {
+                macs[i].mac[j] = rand() & 0xff;
+            }
+            macs[i].mac[0] &= 0xfe; // unicast
+        }
+
+        // Legacy map
+        LegacyCamTable *legacy = new LegacyCamTable;
+        size_t hits = 0;
+        double start = now_sec();
+        for (size_t i=0; i < BENCH_FRAMES; i++) {
+            MacAddress src(macs[i % hosts]);
+            MacAddress dst(macs[(i * 7 + 3) % hosts]);
+            legacy->update(src, ports[i % BENCH_PORTS]);
+            if (legacy->get_port(dst)) {
+                hits++;
+            }
+        }
+        report("map", hosts, now_sec() - start, hits);
+        delete legacy;
+
+        // Packed hash
+        CamTable *camtable = new CamTable;
+        camtable->set_ports(ports);
+        hits = 0;
+        start = now_sec();
+        for (size_t i=0; i < BENCH_FRAMES; i++) {
+            camtable->update(mac_key(macs[i % hosts].mac), ports[i % BENCH_PORTS]);
+            if (camtable->lookup(mac_key(macs[(i * 7 + 3) % hosts].mac))) {
+                hits++;
+            }
+        }
+        report("hash", hosts, now_sec() - start, hits);
+        delete camtable;
+    }
+
+    while (!ports.empty()) {
+        delete ports.back();
+        ports.pop_back();
+    }
+
+    return 0;
+}
@@ -0,0 +1,175 @@
+/*
+ * Multicast forwarding microbenchmark
+ * Measures IgmpTable::process_multicast_packet() on IPv4 multicast data
+ * frames with the MAC fast path and with full IP header parsing. First
+ * checks that MLD snooping floods groups it must not prune.
+ */
+
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <string.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <netinet/ip6.h>
+#include "igmp.h"
+#include "mld.h"
+#include "pool.h"
+#include "rcu.h"
+
+using namespace std;
+
+#define BENCH_PORTS     16
+#define BENCH_FRAMES    (4 * 1000 * 1000)
+#define BENCH_STREAMS   65536   // distinct frames cycled through
+
+
+static u_int32_t group_addr(unsigned int group)
+{
+    return 0xef000000 | (group * 0x10101 & 0x7fffff);  // 239.x.x.x, distinct MACs
+}
+
+
+// IPv6 frame from port 0 to group, ICMPv6 of type icmp_type
+static int mld_forward(MldTable *mldtable, PacketPool *pool, Port *port, const char *group,
+                       u_int8_t icmp_type, u_int64_t *egress)
+{
+    u_int8_t data[sizeof(struct ethhdr) + sizeof(struct ip6_hdr) + 24];
+    memset(data, 0, sizeof(data));
+    struct ethhdr *eth_hdr = (struct ethhdr *) data;
+    struct ip6_hdr *ip6 = (struct ip6_hdr *) (data + sizeof(struct ethhdr));
+    inet_pton(AF_INET6, group, &(ip6->ip6_dst));
+    eth_hdr->h_dest[0] = 0x33;
+    eth_hdr->h_dest[1] = 0x33;
+    memcpy(eth_hdr->h_dest + 2, ip6->ip6_dst.s6_addr + 12, 4);
+    eth_hdr->h_proto = htons(ETH_P_IPV6);
+    ip6->ip6_vfc = 0x60;
+    ip6->ip6_plen = htons(24);
+    ip6->ip6_nxt = IPPROTO_ICMPV6;
+    ip6->ip6_hlim = 255;
+    data[sizeof(struct ethhdr) + sizeof(struct ip6_hdr)] = icmp_type;
+
+    PacketBuf *buf = pool->alloc(data, sizeof(data));
+    *egress = 0;
+    int ret = mldtable->process_multicast_packet(port, buf, egress);
+    packet_put(buf);
+    return ret;
+}
+
+
+// Groups without listeners have to reach hosts that joined before the
+// switch started or whose membership aged out without a querier
+static bool check_mld_flooding(vector<Port*> &ports, PacketPool *pool)
+{
+    MldTable mldtable;
+    mldtable.set_ports(ports);
+    bool ok = true;
+    u_int64_t egress;
+
+    // Neighbor solicitation to unregistered solicited-node group
+    if (mld_forward(&mldtable, pool, ports[0], "ff02::1:ff00:1234", 135, &egress) != MULT_BROADCAST) {
+        printf("MLD: neighbor solicitation to solicited-node group not flooded\n");
+        ok = false;
+    }
+    if (mld_forward(&mldtable, pool, ports[0], "ff05::1:3", 17, &egress) != MULT_BROADCAST) {
+        printf("MLD: unregistered group not flooded without querier\n");
+        ok = false;
+    }
+
+    // Querier seen - unregistered group goes only to it, ND is still flooded
+    mldtable.add_querier(ports[1]);
+    if (mld_forward(&mldtable, pool, ports[0], "ff05::1:3", 17, &egress) != MULT_OK || egress != (1ULL << 1)) {
+        printf("MLD: unregistered group not sent to querier only\n");
+        ok = false;
+    }
+    if (mld_forward(&mldtable, pool, ports[0], "ff02::1:ff00:1234", 135, &egress) != MULT_BROADCAST) {
+        printf("MLD: neighbor solicitation not flooded with querier\n");
+        ok = false;
+    }
+
+    printf("MLD flooding check: %s\n\n", ok ? "OK" : "FAILED");
+    return ok;
+}
+
+
+int main()
+{
+    coarse_clock_update();
+    rcu_register();
+
+    vector<Port*> ports;
+    for (unsigned int i=0; i < BENCH_PORTS; i++) {
+        Port *port = new Port();
+        port->index = i;
+        ports.push_back(port);
+    }
+
+    PacketPool pool(BENCH_STREAMS, 128);
+    if (!check_mld_flooding(ports, &pool)) {
+        return 1;
+    }
+
+    vector<PacketBuf*> frames;
+    size_t group_counts[] = { 16, 1024, 65536 };
+
+    printf("%-8s %-8s %10s %10s\n", "groups", "path", "Mframes/s", "ns/frame");
+    for (size_t g=0; g < sizeof(group_counts) / sizeof(group_counts[0]); g++) {
+        size_t groups = group_counts[g];
+        IgmpTable igmptable;
+        igmptable.set_ports(ports);
+        for (size_t i=0; i < groups; i++) {
+            igmptable.add_group(group_addr(i));
+            igmptable.add_group_member(group_addr(i), ports[i % BENCH_PORTS]);
+            igmptable.add_group_member(group_addr(i), ports[(i * 7 + 1) % BENCH_PORTS]);
+        }
+
+        // UDP frames to the groups
+        srand(1);
+        for (unsigned int i=0; i < BENCH_STREAMS; i++) {
+            u_int8_t data[64];
+            memset(data, 0, sizeof(data));
+            struct ethhdr *eth_hdr = (struct ethhdr *) data;
+            struct iphdr *ip_hdr = (struct iphdr *) (data + sizeof(struct ethhdr));
+            u_int32_t group = group_addr(rand() % groups);
+            eth_hdr->h_dest[0] = 0x01;
+            eth_hdr->h_dest[2] = 0x5e;
+            eth_hdr->h_dest[3] = (group >> 16) & 0x7f;
+            eth_hdr->h_dest[4] = (group >> 8) & 0xff;
+            eth_hdr->h_dest[5] = group & 0xff;
+            eth_hdr->h_proto = htons(ETH_P_IP);
+            ip_hdr->version = 4;
+            ip_hdr->ihl = 5;
+            ip_hdr->protocol = IPPROTO_UDP;
+            ip_hdr->daddr = htonl(group);
+            frames.push_back(pool.alloc(data, sizeof(data)));
+        }
+
+        for (int fast=1; fast >= 0; fast--) {
+            igmptable.mac_fast_path = fast;
+            u_int64_t sum = 0;
+            u_int64_t start = mono_ns();
+            for (size_t i=0; i < BENCH_FRAMES; i++) {
+                u_int64_t egress;
+                igmptable.process_multicast_packet(ports[0], frames[i % BENCH_STREAMS], &egress);
+                sum += egress;
+            }
+            double elapsed = (mono_ns() - start) / 1e9;
+            printf("%-8zu %-8s %10.2f %10.1f  (%llx)\n", groups, fast ? "mac" : "ip",
+                   BENCH_FRAMES / elapsed / 1e6, elapsed * 1e9 / BENCH_FRAMES, (unsigned long long) sum);
+        }
+
+        while (!frames.empty()) {
+            packet_put(frames.back());
+            frames.pop_back();
+        }
+    }
+
+    rcu_unregister();
+    rcu_reclaim_all();
+    while (!ports.empty()) {
+        delete ports.back();
+        ports.pop_back();
+    }
+    return 0;
+}
@@ -0,0 +1,337 @@
+/*
+ * Forwarding path benchmark
+ * Generator threads act as port threads of virtual ports and push frames
+ * of a selected traffic mix through handler(). TX workers of the virtual
+ * ports drain the egress queues into memory rings. Every mix is measured
+ * with 1 up to N generator threads. Generators are port threads of
+ * different ports, or with one_port set all of them are receive workers of
+ * the first port (as with PACKET_FANOUT on one busy interface).
+ *
+ * Usage: bench_switch [max_threads] [ms_per_run] [one_port]
+ */
+
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/igmp.h>
+#include "port_thread.h"
+#include "rcu.h"
+
+using namespace std;
+
+#define BENCH_MIN_PORTS     4
+#define BENCH_HOSTS         256     // learned hosts behind every port
+#define BENCH_GROUPS        64
+#define BENCH_TEMPLATES     1024    // prepared frames per generator
+#define BENCH_FRAME_LEN     64
+#define BENCH_DEF_MS        500
+
+#define MIX_KNOWN       0   // unicast to learned hosts on other ports
+#define MIX_UNKNOWN     1   // unicast to never seen hosts (flooded)
+#define MIX_BROADCAST   2
+#define MIX_MULTICAST   3   // IPv4 multicast data to groups with members
+#define MIX_IGMP        4   // IGMP reports and leaves
+#define MIX_COUNT       5
+
+static const char *mix_names[MIX_COUNT] = { "known", "unknown", "broadcast", "multicast", "igmp" };
+
+
+class Generator {
+    public:
+        PortThreadData tdata;
+        unsigned int port_count;
+        int mix;
+        volatile int *stop;
+        size_t frames;
+        u_int8_t templates[BENCH_TEMPLATES][BENCH_FRAME_LEN];
+};
+
+
+static void host_mac(u_int8_t *mac, unsigned int port, unsigned int host)
+{
+    mac[0] = 0x02;
+    mac[1] = 0x00;
+    mac[2] = port >> 8;
+    mac[3] = port & 0xff;
+    mac[4] = host >> 8;
+    mac[5] = host & 0xff;
+}
+
+
+static u_int32_t group_addr(unsigned int group)
+{
+    return 0xef010000 | group;  // 239.1.x.x
+}
+
+
+static void ip_frame(u_int8_t *frame, u_int32_t daddr, u_int8_t protocol)
+{
+    struct ethhdr *eth_hdr = (struct ethhdr *) frame;
+    struct iphdr *ip_hdr = (struct iphdr *) (frame + sizeof(struct ethhdr));
+
+    eth_hdr->h_proto = htons(ETH_P_IP);
+    ip_hdr->version = 4;
+    ip_hdr->ihl = 5;
+    ip_hdr->ttl = 1;
+    ip_hdr->protocol = protocol;
+    ip_hdr->tot_len = htons(BENCH_FRAME_LEN - sizeof(struct ethhdr));
+    ip_hdr->daddr = htonl(daddr);
+
+    eth_hdr->h_dest[0] = 0x01;
+    eth_hdr->h_dest[1] = 0x00;
+    eth_hdr->h_dest[2] = 0x5e;
+    eth_hdr->h_dest[3] = (daddr >> 16) & 0x7f;
+    eth_hdr->h_dest[4] = (daddr >> 8) & 0xff;
+    eth_hdr->h_dest[5] = daddr & 0xff;
+}
+
+
+static void build_templates(Generator *gen)
+{
+    unsigned int port = gen->tdata.port->index;
+
+    memset(gen->templates, 0, sizeof(gen->templates));
+    for (unsigned int i=0; i < BENCH_TEMPLATES; i++) {
+        u_int8_t *frame = gen->templates[i];
+        struct ethhdr *eth_hdr = (struct ethhdr *) frame;
+        unsigned int r = rand();
+
+        host_mac(eth_hdr->h_source, port, r % BENCH_HOSTS);
+        eth_hdr->h_proto = htons(ETH_P_IP);
+
+        switch (gen->mix) {
+            case MIX_KNOWN:
+                host_mac(eth_hdr->h_dest, (port + 1 + (r >> 8) % (gen->port_count - 1)) % gen->port_count,
+                         (r >> 16) % BENCH_HOSTS);
+                break;
+            case MIX_UNKNOWN:
+                host_mac(eth_hdr->h_dest, 0xffff, r >> 8);
+                break;
+            case MIX_BROADCAST:
+                memset(eth_hdr->h_dest, 0xff, ETH_ALEN);
+                break;
+            case MIX_MULTICAST:
+                ip_frame(frame, group_addr((r >> 8) % BENCH_GROUPS), IPPROTO_UDP);
+                break;
+            case MIX_IGMP: {
+                u_int32_t group = group_addr((r >> 8) % BENCH_GROUPS);
+                ip_frame(frame, group, IPPROTO_IGMP);
+                struct igmphdr *igmp_hdr = (struct igmphdr *) (frame + sizeof(struct ethhdr) + sizeof(struct iphdr));
+                igmp_hdr->type = (i & 1) ? IGMP_HOST_LEAVE_MESSAGE : IGMPV2_HOST_MEMBERSHIP_REPORT;
+                igmp_hdr->group = htonl(group);
+                break;
+            }
+        }
+    }
+}
+
+
+static void *generator_thread(void *arg)
+{
+    Generator *gen = (Generator *) arg;
+    struct pcap_pkthdr header;
+    size_t frames = 0;
+
+    header.caplen = BENCH_FRAME_LEN;
+    header.len = BENCH_FRAME_LEN;
+    header.ts.tv_sec = 0;
+    header.ts.tv_usec = 0;
+
+    rcu_register();
+    gen->tdata.burst_len = 0;
+    gen->tdata.egress.resize(gen->port_count);
+    while (!*(gen->stop)) {
+        for (unsigned int i=0; i < BENCH_TEMPLATES; i++) {
+            if ((i & (BURST_SIZE - 1)) == 0) {
+                // Back-pressure - don't measure frames dropped for lack of buffers
+                while (gen->tdata.pool->in_use() > gen->tdata.pool->count / 2 && !*(gen->stop)) {
+                    sched_yield();
+                }
+            }
+            handler((u_char *) &(gen->tdata), &header, gen->templates[i]);
+        }
+        frames += BENCH_TEMPLATES;
+    }
+    process_burst(&(gen->tdata));
+    rcu_unregister();
+    gen->frames = frames;
+    return NULL;
+}
+
+
+class RunResult {
+    public:
+        double mpps;
+        size_t drops;
+        double cam_contended;   // share of contended acquisitions
+        double cam_wait_ns;     // per frame
+        double igmp_contended;
+        double igmp_wait_ns;
+};
+
+
+static RunResult run(int mix, unsigned int threads, unsigned int port_count, unsigned int run_ms, bool one_port)
+{
+    PortConfig config;
+    config.backend = PORT_BACKEND_VIRTUAL;
+
+    vector<Port*> ports;
+    for (unsigned int i=0; i < port_count; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "v%u", i);
+        Port *port = new Port(name, config);
+        port->index = i;
+        ports.push_back(port);
+    }
+
+    CamTable camtable;
+    IgmpTable igmptable;
+    MldTable mldtable;
+    Learner learner(&camtable, LEARN_QUEUE_LEN);
+    PacketPool pool(POOL_DEF_BUFFERS, config.ring_frame_size);
+    camtable.set_ports(ports);
+    igmptable.set_ports(ports);
+    mldtable.set_ports(ports);
+    learner.set_ports(ports);
+
+    // Learned hosts and group members
+    for (unsigned int p=0; p < port_count; p++) {
+        for (unsigned int h=0; h < BENCH_HOSTS; h++) {
+            u_int8_t mac[ETH_ALEN];
+            host_mac(mac, p, h);
+            camtable.update(mac_key(mac), ports[p]);
+        }
+    }
+    for (unsigned int g=0; g < BENCH_GROUPS; g++) {
+        igmptable.add_group(group_addr(g));
+        for (unsigned int p=0; p < port_count; p++) {
+            if ((g + p) % 2 == 0) {
+                igmptable.add_group_member(group_addr(g), ports[p]);
+            }
+        }
+    }
+
+    pthread_t learner_tid;
+    pthread_create(&learner_tid, NULL, learner_thread, &learner);
+    vector<pthread_t> tx_threads(port_count);
+    for (unsigned int i=0; i < port_count; i++) {
+        pthread_create(&tx_threads[i], NULL, port_tx_thread, ports[i]);
+    }
+
+    volatile int stop = 0;
+    vector<Generator*> gens;
+    for (unsigned int i=0; i < threads; i++) {
+        Generator *gen = new Generator;
+        gen->tdata.camtable = &camtable;
+        gen->tdata.igmptable = &igmptable;
+        gen->tdata.mldtable = &mldtable;
+        gen->tdata.learner = &learner;
+        gen->tdata.port = ports[one_port ? 0 : i];
+        gen->tdata.worker = one_port ? i : 0;
+        gen->tdata.cpu = -1;
+        gen->tdata.pool = &pool;
+        gen->tdata.ports = &ports;
+        gen->tdata.rx_counter = &(gen->tdata.port->rx_counter[gen->tdata.worker]);
+        gen->port_count = port_count;
+        gen->mix = mix;
+        gen->stop = &stop;
+        gen->frames = 0;
+        build_templates(gen);
+        gens.push_back(gen);
+    }
+
+    LockStat cam_start = camtable.lock_stat;
+    LockStat igmp_start = igmptable.lock_stat;
+    vector<pthread_t> gen_threads(threads);
+    u_int64_t start = mono_ns();
+    for (unsigned int i=0; i < threads; i++) {
+        pthread_create(&gen_threads[i], NULL, generator_thread, gens[i]);
+    }
+    usleep(run_ms * 1000);
+    stop = 1;
+    size_t frames = 0;
+    for (unsigned int i=0; i < threads; i++) {
+        pthread_join(gen_threads[i], NULL);
+        frames += gens[i]->frames;
+        delete gens[i];
+    }
+    double elapsed = (mono_ns() - start) / 1e9;
+    learner.stop();
+    pthread_join(learner_tid, NULL);
+
+    RunResult res;
+    size_t cam_acquired = camtable.lock_stat.acquired - cam_start.acquired;
+    size_t igmp_acquired = igmptable.lock_stat.acquired - igmp_start.acquired;
+    res.mpps = frames / elapsed / 1e6;
+    res.cam_contended = cam_acquired ? (double) (camtable.lock_stat.contended - cam_start.contended) / cam_acquired : 0;
+    res.cam_wait_ns = frames ? (double) (camtable.lock_stat.wait_ns - cam_start.wait_ns) / frames : 0;
+    res.igmp_contended = igmp_acquired ? (double) (igmptable.lock_stat.contended - igmp_start.contended) / igmp_acquired : 0;
+    res.igmp_wait_ns = frames ? (double) (igmptable.lock_stat.wait_ns - igmp_start.wait_ns) / frames : 0;
+    res.drops = pool.exhausted;
+
+    for (unsigned int i=0; i < port_count; i++) {
+        ports[i]->stop();
+    }
+    for (unsigned int i=0; i < port_count; i++) {
+        pthread_join(tx_threads[i], NULL);
+        res.drops += ports[i]->queue->drops;
+    }
+    while (!ports.empty()) {
+        delete ports.back();
+        ports.pop_back();
+    }
+    return res;
+}
+
+
+int main(int argc, char **argv)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int max_threads = argc > 1 ? atoi(argv[1]) : (cpus > 0 ? cpus : 1);
+    unsigned int run_ms = argc > 2 ? atoi(argv[2]) : BENCH_DEF_MS;
+    bool one_port = argc > 3 && atoi(argv[3]);
+    if (max_threads == 0) {
+        max_threads = 1;
+    }
+    if (one_port && max_threads > PORT_RX_COUNTERS) {
+        max_threads = PORT_RX_COUNTERS;
+    }
+    unsigned int port_count = max_threads < BENCH_MIN_PORTS ? BENCH_MIN_PORTS : max_threads;
+
+    coarse_clock_update();
+    classify_impl();
+    srand(1);
+
+    printf("%u ports%s, %u ms per run, classifier %s\n", port_count, one_port ? " (all threads receive on first port)" : "",
+           run_ms, classify_impl_name(classify_impl()));
+    printf("%-10s %7s %9s %8s %10s %9s %12s %9s %12s\n", "mix", "threads", "Mframes/s", "speedup",
+           "drops", "cam-cont", "cam-wait/fr", "igmp-cont", "igmp-wait/fr");
+
+    for (int mix=0; mix < MIX_COUNT; mix++) {
+        double base = 0;
+        // 1, 2, 4, ... max_threads
+        for (unsigned int threads=1; ; threads *= 2) {
+            if (threads > max_threads) {
+                threads = max_threads;
+            }
+            RunResult res = run(mix, threads, port_count, run_ms, one_port);
+            if (threads == 1) {
+                base = res.mpps;
+            }
+            printf("%-10s %7u %9.3f %7.2fx %10zu %8.1f%% %9.1f ns %8.1f%% %9.1f ns\n", mix_names[mix], threads,
+                   res.mpps, base > 0 ? res.mpps / base : 0, res.drops, res.cam_contended * 100,
+                   res.cam_wait_ns, res.igmp_contended * 100, res.igmp_wait_ns);
+            if (threads == max_threads) {
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
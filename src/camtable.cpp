@@ -1,6 +1,9 @@
+#include <new>
 #include <sstream>
+#include <stdlib.h>
 #include <assert.h> 
 #include "camtable.h"
+#include "queue.h"
 
 using namespace std;
 
@@ -19,6 +22,11 @@ MacAddress::MacAddress(unsigned char mac[])
     }
 }
 
+MacAddress::MacAddress(u_int64_t key)
+{
+    memcpy(this->mac, &key, ETH_ALEN);
+}
+
 
 void MacAddress::print()
 {
@@ -48,34 +56,27 @@ MacAddress::MacAddress(const MacAddress &second)
 }
 
 
+u_int64_t MacAddress::key() const
+{
+    return mac_key(this->mac);
+}
+
+
 bool MacAddress::is_broadcast()
 {
-    for (int i=0; i < ETH_ALEN; i++) {
-        if (this->mac[i] != 255) {
-            return false;
-        }
-    }
-    return true;
+    return mac_key(this->mac) == CAM_BROADCAST_KEY;
 }
 
 
 bool MacAddress::is_multicast()
 {
-    if (this->mac[0] == 1 && this->mac[1] == 0 && this->mac[2] == 94) {
-        return true;
-    }
-    return false;
+    return mac_is_multicast(this->mac);
 }
 
 
 bool MacAddress::operator==(const MacAddress &second) const
 {
-    for (int i=0; i < ETH_ALEN; i++) {
-        if (this->mac[i] != second.mac[i]) {
-            return false;
-        }
-    }
-    return true;
+    return mac_key(this->mac) == mac_key(second.mac);
 }
 
 
@@ -98,128 +99,289 @@ bool MacAddress::operator<(const MacAddress &second) const
 
 
 
-CamRecord::CamRecord(MacAddress &mac, Port *port)
+CamTable::CamTable()
 {
-    this->mac = mac;
-    this->port = port;
-    this->last_used = time(NULL);
+    pthread_mutex_init(&(this->write_mutex), NULL);
+    if (posix_memalign((void **) &(this->buckets), sizeof(CamBucket),
+                       CAM_BUCKETS * sizeof(CamBucket))) {
+        throw std::bad_alloc();
+    }
+    memset(this->buckets, 0, CAM_BUCKETS * sizeof(CamBucket));
+    this->generation = 1;
 }
 
 
-void CamRecord::refresh()
+CamTable::~CamTable()
 {
-    this->last_used = time(NULL);
+    pthread_mutex_destroy(&(this->write_mutex));
+    free(this->buckets);
 }
 
 
-int CamRecord::send_via_port(const void *buf, size_t size)
+
+void CamTable::set_ports(vector<Port*> ports)
 {
-    assert(this->port);
-    return this->port->send(buf, size);
+    this->ports = ports;
 }
 
 
+// Every key has two candidate buckets (bucketized cuckoo hashing without
+// displacement), so lookup touches at most two cache lines
+void CamTable::get_buckets(u_int64_t key, size_t *first, size_t *second)
+{
+    u_int64_t hash = key * 0x9e3779b97f4a7c15ULL;
+    *first = (hash >> 40) & (CAM_BUCKETS - 1);
+    *second = (hash >> 16) & (CAM_BUCKETS - 1);
+    if (*second == *first) {
+        *second = *first ^ 1;
+    }
+}
 
-CamTable::CamTable()
+
+Port *CamTable::entry_port(u_int64_t entry)
 {
-    pthread_mutex_init(&(this->mutex), NULL);
+    size_t index = (entry >> CAM_PORT_SHIFT) - 1;
+    assert(index < this->ports.size());
+    return this->ports[index];
 }
 
 
-CamTable::~CamTable()
+// Consistent snapshot of bucket entries (seqlock read side)
+void CamTable::read_bucket(CamBucket *bucket, u_int64_t *entries)
 {
-    pthread_mutex_destroy(&(this->mutex));
+    u_int32_t seq1, seq2;
+    do {
+        while ((seq1 = __atomic_load_n(&(bucket->seq), __ATOMIC_ACQUIRE)) & 1) {
+            cpu_relax();
+        }
+        for (int j=0; j < CAM_BUCKET_SLOTS; j++) {
+            entries[j] = __atomic_load_n(&(bucket->entry[j]), __ATOMIC_RELAXED);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        seq2 = __atomic_load_n(&(bucket->seq), __ATOMIC_RELAXED);
+    } while (seq1 != seq2);
 }
 
 
+// Seqlock write side, caller has to hold write_mutex
+void CamTable::write_entry(CamBucket *bucket, int slot, u_int64_t entry)
+{
+    u_int32_t seq = bucket->seq;
+    u_int64_t old = bucket->entry[slot];
+    __atomic_store_n(&(bucket->seq), seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&(bucket->entry[slot]), entry, __ATOMIC_RELAXED);
+    __atomic_store_n(&(bucket->seq), seq + 2, __ATOMIC_RELEASE);
+    if (old) {
+        // Forwarding caches may hold the old record
+        __atomic_fetch_add(&(this->generation), 1, __ATOMIC_RELEASE);
+    }
+}
 
-void CamTable::set_ports(vector<Port*> ports)
+
+// Lock free search, returns 1 and location of the record if key is known
+int CamTable::find(u_int64_t key, CamBucket **bucket, int *slot, u_int64_t *entry)
 {
-    this->ports = ports;
+    size_t b[2];
+    u_int64_t entries[CAM_BUCKET_SLOTS];
+
+    get_buckets(key, &b[0], &b[1]);
+    for (int i=0; i < 2; i++) {
+        read_bucket(&(this->buckets[b[i]]), entries);
+        for (int j=0; j < CAM_BUCKET_SLOTS; j++) {
+            if (entries[j] && (entries[j] & CAM_KEY_MASK) == key) {
+                *bucket = &(this->buckets[b[i]]);
+                *slot = j;
+                *entry = entries[j];
+                return 1;
+            }
+        }
+    }
+    return 0;
 }
 
 
 
-int CamTable::update(MacAddress &mac, Port *port)
+int CamTable::update(u_int64_t key, Port *port)
 {
     int ret;
-    RecordTable::iterator it;
-    pthread_mutex_lock(&(this->mutex));
-    it = this->records.find(mac.str());
+    size_t b[2];
+    u_int64_t entry = key | ((u_int64_t) (port->index + 1) << CAM_PORT_SHIFT);
+    u_int64_t cur_entry;
+    u_int32_t now = coarse_time();
+    CamBucket *bucket;
+    int slot;
+
+    // Fast path without lock - known address on the same port
+    if (find(key, &bucket, &slot, &cur_entry) && cur_entry == entry) {
+        // Refresh last_used value (write only when it changes to keep the cache line shared)
+        if (__atomic_load_n(&(bucket->last_used[slot]), __ATOMIC_RELAXED) != now) {
+            __atomic_store_n(&(bucket->last_used[slot]), now, __ATOMIC_RELAXED);
+        }
+        return 0;
+    }
 
-    if (it == this->records.end()) {
+    CamBucket *free_bucket = NULL;
+    int free_slot = 0;
+    int free_cnt = 0;
+
+    get_buckets(key, &b[0], &b[1]);
+    lock_acquire(&(this->write_mutex), &(this->lock_stat));
+
+    for (int i=0; i < 2; i++) {
+        bucket = &(this->buckets[b[i]]);
+        int cnt = 0;
+        slot = 0;
+        for (int j=0; j < CAM_BUCKET_SLOTS; j++) {
+            if (bucket->entry[j] == 0) {
+                cnt++;
+                slot = j;
+            } else if ((bucket->entry[j] & CAM_KEY_MASK) == key) {
+                // Known address -> refresh last_used value (and port if the station moved)
+                if (bucket->entry[j] != entry) {
+                    write_entry(bucket, j, entry);
+                }
+                __atomic_store_n(&(bucket->last_used[j]), now, __ATOMIC_RELAXED);
+                pthread_mutex_unlock(&(this->write_mutex));
+                return 0;
+            }
+        }
+        // Prefer the less loaded of both buckets
+        if (cnt > free_cnt) {
+            free_cnt = cnt;
+            free_bucket = bucket;
+            free_slot = slot;
+        }
+    }
+
+    if (free_bucket) {
         // Unknown source mac address -> Create record
-        CamRecord *camrecord = new CamRecord(mac, port);
-        this->records[mac.str()] = camrecord;
+        __atomic_store_n(&(free_bucket->last_used[free_slot]), now, __ATOMIC_RELAXED);
+        write_entry(free_bucket, free_slot, entry);
+        this->wheel.add(key, now + PURGE_TIMEOUT + 1);
         ret = 1;
     } else {
-		// Refresh last_used value
-        it->second->refresh();
-        ret = 0;
+        // Both buckets are full
+        ret = -1;
     }
 
-    pthread_mutex_unlock(&(this->mutex));
+    pthread_mutex_unlock(&(this->write_mutex));
     return ret;
 }
 
 
 void CamTable::print_table()
 {
-    RecordTableIterator it;
-    time_t cur_time = time(NULL);
+    time_t cur_time = coarse_time();
+    u_int64_t entries[CAM_BUCKET_SLOTS];
 
     printf("MAC address\tPort\tAge\n");
 
-    pthread_mutex_lock(&(this->mutex));
-    for (it=this->records.begin(); it != this->records.end(); it++) {
-        CamRecord *rec = it->second;
-        string mac_str = rec->mac.str();
-        printf("%s\t%s\t%ld\n", mac_str.c_str(), rec->port->name.c_str(), (cur_time - rec->last_used));
+    // Lock free scan, port threads are not blocked while printing
+    for (size_t i=0; i < CAM_BUCKETS; i++) {
+        CamBucket *bucket = &(this->buckets[i]);
+        read_bucket(bucket, entries);
+        for (int j=0; j < CAM_BUCKET_SLOTS; j++) {
+            if (entries[j] == 0) {
+                continue;
+            }
+            MacAddress mac(entries[j] & CAM_KEY_MASK);
+            string mac_str = mac.str();
+            u_int32_t last_used = __atomic_load_n(&(bucket->last_used[j]), __ATOMIC_RELAXED);
+            printf("%s\t%s\t%ld\n", mac_str.c_str(), entry_port(entries[j])->name.c_str(),
+                   (long) (cur_time - last_used));
+        }
     }
-
-    pthread_mutex_unlock(&(this->mutex));
 }
 
 
-CamRecord *CamTable::get_record(MacAddress &mac)
+int CamTable::get(u_int64_t key, Port **port, u_int32_t *last_used)
 {
-    CamRecord * ret = NULL;
-    RecordTable::iterator it;
-    pthread_mutex_lock(&(this->mutex));
-    it = this->records.find(mac.str());
-    if (! (it == this->records.end())) {
-        ret = it->second;
+    CamBucket *bucket;
+    int slot;
+    u_int64_t entry;
+
+    if (!find(key, &bucket, &slot, &entry)) {
+        return 0;
     }
-    pthread_mutex_unlock(&(this->mutex));
-    return ret;
+    *port = entry_port(entry);
+    *last_used = __atomic_load_n(&(bucket->last_used[slot]), __ATOMIC_RELAXED);
+    return 1;
 }
 
 
-void CamTable::broadcast(Port *source_port, const void *buf, size_t size)
+u_int64_t CamTable::get_generation()
 {
-    for (unsigned int i=0; i < this->ports.size(); i++) {
-        if (this->ports[i] != source_port) {
-            this->ports[i]->send(buf, size);
-        }
+    return __atomic_load_n(&(this->generation), __ATOMIC_ACQUIRE);
+}
+
+
+Port *CamTable::lookup(u_int64_t key)
+{
+    CamBucket *bucket;
+    int slot;
+    u_int64_t entry;
+
+    if (find(key, &bucket, &slot, &entry)) {
+        return entry_port(entry);
     }
+    return NULL;
+}
+
+
+// Issued for a whole burst before the first lookup, so the cache misses
+// of all frames overlap instead of being paid one after another
+void CamTable::prefetch(u_int64_t key)
+{
+    size_t b[2];
+    get_buckets(key, &b[0], &b[1]);
+    __builtin_prefetch(&(this->buckets[b[0]]), 0, 3);
+    __builtin_prefetch(&(this->buckets[b[1]]), 0, 3);
 }
 
 
+// Only records whose timer expired are visited. Refreshing a record
+// doesn't touch the wheel, timer of a refreshed record is just added again.
 void CamTable::purge()
 {
-    RecordTable::iterator it;
-    time_t cur_time = time(NULL);   
-    pthread_mutex_lock(&(this->mutex));
-    for (it=this->records.begin(); it != this->records.end(); ) {
-        CamRecord *rec = it->second;
-        if ((cur_time - rec->last_used) > PURGE_TIMEOUT) {
-            delete rec;
-            this->records.erase(it++);
+    vector<WheelTimer> expired;
+    u_int32_t now = coarse_time();
+    CamBucket *bucket;
+    int slot;
+    u_int64_t entry;
+
+    lock_acquire(&(this->write_mutex), &(this->lock_stat));
+    this->wheel.advance(now, expired);
+    for (size_t i=0; i < expired.size(); i++) {
+        if (!find(expired[i].id, &bucket, &slot, &entry)) {
+            continue;
+        }
+        u_int32_t last_used = __atomic_load_n(&(bucket->last_used[slot]), __ATOMIC_RELAXED);
+        if ((int32_t) (now - last_used) > PURGE_TIMEOUT) {
+            write_entry(bucket, slot, 0);
         } else {
-            ++it;
+            this->wheel.add(expired[i].id, last_used + PURGE_TIMEOUT + 1);
         }
     }
-    pthread_mutex_unlock(&(this->mutex));
+    pthread_mutex_unlock(&(this->write_mutex));
 }
 
 
+
+FwdCache::FwdCache()
+{
+    this->generation = 0;
+    this->hits = 0;
+    this->misses = 0;
+    memset(this->entries, 0, sizeof(this->entries));
+}
+
+
+void FwdCache::sync(CamTable *camtable)
+{
+    u_int64_t generation = camtable->get_generation();
+    if (generation != this->generation) {
+        memset(this->entries, 0, sizeof(this->entries));
+        this->generation = generation;
+    }
+}
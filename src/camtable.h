@@ -2,26 +2,56 @@
 #define __SWITCH_CAMTABLE_H__
 
 #include <ctime>
-#include <map>
+#include <string>
 #include <vector>
+#include <string.h>
+#include <sys/types.h>
 #include <linux/if_ether.h>
 #include "port.h"
+#include "aging.h"
+#include "lockstat.h"
 
 #define PURGE_TIMEOUT   60*5  // in seconds
+#define CAM_REFRESH_INTERVAL    10  // s, known source is sent to the learner again after this time
+#define FWD_CACHE_SLOTS     256     // entries of per thread forwarding cache (power of two)
+
+#define CAM_BUCKET_SLOTS    4           // records in one (cache line sized) bucket
+#define CAM_BUCKETS         (1 << 14)   // must be power of two (capacity = CAM_BUCKETS * CAM_BUCKET_SLOTS)
+#define CAM_KEY_MASK        0x0000ffffffffffffULL
+#define CAM_PORT_SHIFT      48
+#define CAM_BROADCAST_KEY   CAM_KEY_MASK
 
 
 using namespace std;
 
 
+// Pack 6 byte MAC address into the low 48 bits of a 64 bit key
+static inline u_int64_t mac_key(const u_int8_t *mac)
+{
+    u_int64_t key = 0;
+    memcpy(&key, mac, ETH_ALEN);
+    return key;
+}
+
+
+// IPv4 multicast MAC address (01:00:5e prefix)
+static inline bool mac_is_multicast(const u_int8_t *mac)
+{
+    return (mac[0] == 1 && mac[1] == 0 && mac[2] == 94);
+}
+
+
 class MacAddress {
     public:
         u_int8_t  mac[ETH_ALEN];
 
         MacAddress();
         MacAddress(unsigned char mac[]);
+        MacAddress(u_int64_t key);
         void print();
         std::string str();
         MacAddress(const MacAddress &); // copy constructor
+        u_int64_t key() const;
         bool is_broadcast();
         bool is_multicast();
         bool operator==(const MacAddress &) const;
@@ -30,37 +60,97 @@ class MacAddress {
 };
 
 
-class CamRecord {
+// One cache line of the table. Records are stored inline, every record is
+// a single 64 bit word: MAC key in low 48 bits and (port index + 1) in
+// the high 16 bits. Zero word means free slot.
+// Entries are protected by per-bucket sequence lock (odd seq = write in
+// progress), readers never block. last_used is updated without the seqlock.
+class CamBucket {
     public:
-        MacAddress mac;
-        time_t last_used;
-        Port *port;
+        u_int32_t seq;
+        u_int64_t entry[CAM_BUCKET_SLOTS];
+        u_int32_t last_used[CAM_BUCKET_SLOTS];
+} __attribute__((aligned(64)));
 
-        CamRecord(MacAddress &mac, Port *port);
-        void refresh(); // call refresh of last use time
-        int send_via_port(const void *buf, size_t size); // send data
-};
-
-
-typedef std::map<string, CamRecord*> RecordTable;
-typedef std::map<string, CamRecord*>::iterator RecordTableIterator;
 
 class CamTable {
     private:
-        pthread_mutex_t mutex;
+        pthread_mutex_t write_mutex; // serializes writers (learning, aging), readers are lock free
         vector<Port*> ports;
-        RecordTable records;
+        CamBucket *buckets;
+        u_int64_t generation;   // bumped when a record is moved or removed
+        TimingWheel wheel; // one aging timer per record, protected by write_mutex
+
+        void get_buckets(u_int64_t key, size_t *first, size_t *second);
+        Port *entry_port(u_int64_t entry);
+        void read_bucket(CamBucket *bucket, u_int64_t *entries);
+        int find(u_int64_t key, CamBucket **bucket, int *slot, u_int64_t *entry);
+        void write_entry(CamBucket *bucket, int slot, u_int64_t entry);
 
     public:
+        LockStat lock_stat; // contention of write_mutex
+
         CamTable();
         ~CamTable();
         void set_ports(vector<Port*> ports);
-        int update(MacAddress &mac, Port *port); // if doesn't exist -> add new record; if exists -> refresh last_used value
-        void purge();
-        CamRecord *get_record(MacAddress &mac);
-        void broadcast(Port *source_port, const void *buf, size_t size); // send message out via all port except source_port
+        int update(u_int64_t key, Port *port); // if doesn't exist -> add new record; if exists -> refresh last_used value
+        int get(u_int64_t key, Port **port, u_int32_t *last_used); // lock free, 0 if the key is unknown
+        u_int64_t get_generation();
+        void purge(); // remove records whose aging timer expired
+        Port *lookup(u_int64_t key); // returns port where the MAC was learned or NULL
+        void prefetch(u_int64_t key); // bring both candidate buckets of the key to cache
         void print_table();
 };
 
-#endif /* __SWITCH_CAMTABLE_H__ */
 
+
+class FwdCacheEntry {
+    public:
+        u_int64_t key;          // 0 = empty
+        Port *port;
+        u_int32_t last_used;    // copy of the CAM record age
+};
+
+
+// Direct mapped cache of CAM records owned by one port thread, so frames
+// of established conversations don't touch the shared table at all.
+// Records are only added to the CAM otherwise, so the whole cache is
+// dropped when the CAM generation changes (record moved or removed).
+class FwdCache {
+    public:
+        u_int64_t generation;
+        size_t hits;            // written by the owner only
+        size_t misses;
+        FwdCacheEntry entries[FWD_CACHE_SLOTS];
+
+        FwdCache();
+        void sync(CamTable *camtable);  // once per burst, before the first lookup
+
+        FwdCacheEntry *slot(u_int64_t key)
+        {
+            return &(this->entries[((key * 0x9e3779b97f4a7c15ULL) >> 56) & (FWD_CACHE_SLOTS - 1)]);
+        }
+
+        bool contains(u_int64_t key)
+        {
+            return slot(key)->key == key;
+        }
+
+        // Cached record, on miss it is read from the CAM. NULL if the key is unknown.
+        FwdCacheEntry *lookup(CamTable *camtable, u_int64_t key)
+        {
+            FwdCacheEntry *entry = slot(key);
+            if (entry->key == key && key != 0) {
+                __atomic_store_n(&(this->hits), this->hits + 1, __ATOMIC_RELAXED);
+                return entry;
+            }
+            __atomic_store_n(&(this->misses), this->misses + 1, __ATOMIC_RELAXED);
+            if (!camtable->get(key, &(entry->port), &(entry->last_used))) {
+                return NULL;
+            }
+            entry->key = key;
+            return entry;
+        }
+};
+
+#endif /* __SWITCH_CAMTABLE_H__ */
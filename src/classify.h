@@ -0,0 +1,35 @@
+#ifndef __SWITCH_CLASSIFY_H__
+#define __SWITCH_CLASSIFY_H__
+
+#include <sys/types.h>
+
+#define BURST_SIZE  32  // max frames processed together
+
+#define FRAME_UNICAST       0
+#define FRAME_MULTICAST     1   // IPv4 multicast MAC (01:00:5e prefix)
+#define FRAME_BROADCAST     2
+#define FRAME_MULTICAST6    3   // IPv6 multicast MAC (33:33 prefix)
+
+#define CLASSIFY_SCALAR     0
+#define CLASSIFY_SSE2       1   // x86 only
+
+
+// Classification of one burst, arrays are indexed by the frame position
+class BurstInfo {
+    public:
+        u_int64_t dst_key[BURST_SIZE];  // packed destination MAC (see mac_key())
+        u_int64_t src_key[BURST_SIZE];  // packed source MAC
+        u_int16_t ethertype[BURST_SIZE];  // host byte order
+        u_int8_t cls[BURST_SIZE];       // FRAME_*
+};
+
+
+// Reads Ethernet headers of n (at most BURST_SIZE) frames in one pass.
+// At least 16 bytes of every frame have to be readable.
+void classify_burst(const u_int8_t *const *frames, unsigned int n, BurstInfo *info);
+
+int classify_impl();                    // CLASSIFY_* used by classify_burst()
+int classify_set_impl(int impl);        // force implementation (benchmarks), -1 if CPU lacks support
+const char *classify_impl_name(int impl);
+
+#endif /* __SWITCH_CLASSIFY_H__ */
@@ -0,0 +1,48 @@
+#include "counters.h"
+
+
+RateMeter::RateMeter()
+{
+    pthread_mutex_init(&(this->mutex), NULL);
+    this->count = 0;
+    this->pos = 0;
+}
+
+
+RateMeter::~RateMeter()
+{
+    pthread_mutex_destroy(&(this->mutex));
+}
+
+
+void RateMeter::sample(const RateSample &sample)
+{
+    pthread_mutex_lock(&(this->mutex));
+    this->samples[this->pos] = sample;
+    this->pos = (this->pos + 1) % RATE_SAMPLES;
+    if (this->count < RATE_SAMPLES) {
+        this->count++;
+    }
+    pthread_mutex_unlock(&(this->mutex));
+}
+
+
+void RateMeter::get(double *recv_pps, double *recv_bps, double *send_pps, double *send_bps)
+{
+    *recv_pps = *recv_bps = *send_pps = *send_bps = 0;
+
+    pthread_mutex_lock(&(this->mutex));
+    if (this->count >= 2) {
+        // Oldest and newest sample in the window
+        RateSample *last = &(this->samples[(this->pos + RATE_SAMPLES - 1) % RATE_SAMPLES]);
+        RateSample *first = &(this->samples[(this->pos + RATE_SAMPLES - this->count) % RATE_SAMPLES]);
+        double elapsed = (last->ns - first->ns) / 1e9;
+        if (elapsed > 0) {
+            *recv_pps = (last->recv_f - first->recv_f) / elapsed;
+            *recv_bps = (last->recv_b - first->recv_b) * 8 / elapsed;
+            *send_pps = (last->send_f - first->send_f) / elapsed;
+            *send_bps = (last->send_b - first->send_b) * 8 / elapsed;
+        }
+    }
+    pthread_mutex_unlock(&(this->mutex));
+}
@@ -0,0 +1,57 @@
+#ifndef __SWITCH_COUNTERS_H__
+#define __SWITCH_COUNTERS_H__
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#define RATE_SAMPLES    6   // rate window = RATE_SAMPLES - 1 sampling intervals
+
+
+// Frame/byte counter with a single writer thread, alone in its cache line.
+// Writer does plain load + store (no locked instruction), readers load
+// the values at any time without locking.
+class PortCounter {
+    public:
+        u_int64_t bytes;
+        u_int64_t frames;
+
+        PortCounter() : bytes(0), frames(0) {}
+
+        void add(u_int64_t bytes, u_int64_t frames)
+        {
+            __atomic_store_n(&(this->bytes), __atomic_load_n(&(this->bytes), __ATOMIC_RELAXED) + bytes, __ATOMIC_RELAXED);
+            __atomic_store_n(&(this->frames), __atomic_load_n(&(this->frames), __ATOMIC_RELAXED) + frames, __ATOMIC_RELAXED);
+        }
+        u_int64_t get_bytes() const { return __atomic_load_n(&(this->bytes), __ATOMIC_RELAXED); }
+        u_int64_t get_frames() const { return __atomic_load_n(&(this->frames), __ATOMIC_RELAXED); }
+} __attribute__((aligned(64)));
+
+
+class RateSample {
+    public:
+        u_int64_t ns;
+        u_int64_t recv_f;
+        u_int64_t recv_b;
+        u_int64_t send_f;
+        u_int64_t send_b;
+};
+
+
+// Rates over a sliding window of counter samples. Samples are taken by
+// the aging thread, so the data path is not involved at all.
+class RateMeter {
+    private:
+        pthread_mutex_t mutex;
+        RateSample samples[RATE_SAMPLES];
+        unsigned int count;     // valid samples
+        unsigned int pos;       // next sample goes here
+
+    public:
+        RateMeter();
+        ~RateMeter();
+        void sample(const RateSample &sample);
+        // Per second rates, zero until two samples were taken
+        void get(double *recv_pps, double *recv_bps, double *send_pps, double *send_bps);
+};
+
+#endif /* __SWITCH_COUNTERS_H__ */
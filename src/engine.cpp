@@ -0,0 +1,427 @@
+#include <cstdio>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "engine.h"
+#include "aging.h"
+#include "rcu.h"
+
+using namespace std;
+
+
+static void *engine_thread(void *arg)
+{
+    EngineWorker *worker = (EngineWorker *) arg;
+    worker->engine->run(worker);
+    return NULL;
+}
+
+
+EventEngine::EventEngine(unsigned int workers)
+{
+    this->stopping = 0;
+    this->rx_stopped = 0;
+    this->replays = 0;
+    this->last_rebalance = 0;
+    this->migrations = 0;
+
+    for (unsigned int i=0; i < workers; i++) {
+        EngineWorker *worker = new EngineWorker;
+        worker->engine = this;
+        worker->index = i;
+        worker->epfd = -1;
+        worker->wake_fd = -1;
+        worker->sleeping = 0;
+        worker->cpu = -1;
+        worker->frames = 0;
+        worker->busy_ns = 0;
+        worker->wakeups = 0;
+        pthread_mutex_init(&(worker->mutex), NULL);
+        this->workers.push_back(worker);
+    }
+}
+
+
+EventEngine::~EventEngine()
+{
+    for (size_t i=0; i < this->workers.size(); i++) {
+        EngineWorker *worker = this->workers[i];
+        if (worker->epfd >= 0) {
+            close(worker->epfd);
+        }
+        if (worker->wake_fd >= 0) {
+            close(worker->wake_fd);
+        }
+        pthread_mutex_destroy(&(worker->mutex));
+        delete worker;
+    }
+    for (size_t i=0; i < this->ports.size(); i++) {
+        delete this->ports[i];
+    }
+}
+
+
+int EventEngine::start(vector<PortThreadData*> &threads, Placement &placement, pthread_attr_t *attr)
+{
+    int ret;
+
+    for (size_t i=0; i < threads.size(); i++) {
+        PortThreadData *tdata = threads[i];
+        if (tdata->port->backend == PORT_BACKEND_PCAP) {
+            char errbuf[PCAP_ERRBUF_SIZE];
+            if (pcap_setnonblock(tdata->port->descriptor, 1, errbuf) < 0) {
+                fprintf(stderr, "Couldn't set non-blocking mode on %s: %s\n", tdata->port->name.c_str(), errbuf);
+                return -1;
+            }
+        }
+        if (tdata->port->backend == PORT_BACKEND_FILE) {
+            this->replays++;
+        }
+        port_thread_init(tdata);
+
+        EnginePort *port = new EnginePort;
+        port->tdata = tdata;
+        port->fd = port_poll_fd(tdata);
+        port->owner = -1;
+        port->move_to = -1;
+        port->done = false;
+        port->busy_ns = 0;
+        port->round_busy_ns = 0;
+        this->ports.push_back(port);
+        // Rings of one port (-W) go to different workers
+        this->workers[i % this->workers.size()]->incoming.push_back(port);
+    }
+
+    for (size_t i=0; i < this->workers.size(); i++) {
+        EngineWorker *worker = this->workers[i];
+        struct epoll_event event;
+
+        if ((worker->epfd = epoll_create1(0)) < 0) {
+            perror("epoll_create1()");
+            return -1;
+        }
+        if ((worker->wake_fd = eventfd(0, EFD_NONBLOCK)) < 0) {
+            perror("eventfd()");
+            return -1;
+        }
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, worker->wake_fd, &event) < 0) {
+            perror("epoll_ctl()");
+            return -1;
+        }
+
+        // Rings move between workers, the first one decides the node
+        int node = worker->incoming.empty() ? -1 : worker->incoming[0]->tdata->port->numa_node;
+        worker->cpu = placement.rx_cpu(node);
+        vector<int> cpu(1, worker->cpu);
+        char name[32];
+        snprintf(name, sizeof(name), "worker%zu", i);
+        placement.set_attr(attr, cpu);
+        placement.add_report(name, cpu, node);
+
+        ret = pthread_create(&(worker->thread), attr, engine_thread, (void *) worker);
+        if (ret) {
+            fprintf(stderr, "pthread_create() error: %d\n", ret);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+// Take rings handed over by other workers (and the initial ones)
+void EventEngine::adopt(EngineWorker *worker)
+{
+    vector<EnginePort*> incoming;
+
+    pthread_mutex_lock(&(worker->mutex));
+    incoming.swap(worker->incoming);
+    pthread_mutex_unlock(&(worker->mutex));
+
+    for (size_t i=0; i < incoming.size(); i++) {
+        EnginePort *port = incoming[i];
+        if (port->fd >= 0) {
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.ptr = port;
+            if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, port->fd, &event) < 0) {
+                perror("epoll_ctl()");
+            }
+        }
+        if (port->tdata->worker == 0) {
+            port->tdata->port->queue->set_notify(&(worker->sleeping), worker->wake_fd);
+        }
+        __atomic_store_n(&(port->owner), worker->index, __ATOMIC_RELEASE);
+        worker->owned.push_back(port);
+    }
+}
+
+
+// Give away rings the rebalancer decided to move. The ring is out of the
+// epoll set before the new owner can see it.
+void EventEngine::hand_over(EngineWorker *worker)
+{
+    for (size_t i=0; i < worker->owned.size(); ) {
+        EnginePort *port = worker->owned[i];
+        int target = __atomic_load_n(&(port->move_to), __ATOMIC_ACQUIRE);
+        if (target < 0) {
+            i++;
+            continue;
+        }
+
+        if (port->fd >= 0 && epoll_ctl(worker->epfd, EPOLL_CTL_DEL, port->fd, NULL) < 0) {
+            perror("epoll_ctl()");
+        }
+        worker->owned[i] = worker->owned.back();
+        worker->owned.pop_back();
+        __atomic_store_n(&(port->owner), -1, __ATOMIC_RELAXED);
+        __atomic_store_n(&(port->move_to), -1, __ATOMIC_RELAXED);
+
+        EngineWorker *new_owner = this->workers[target];
+        pthread_mutex_lock(&(new_owner->mutex));
+        new_owner->incoming.push_back(port);
+        pthread_mutex_unlock(&(new_owner->mutex));
+        wake(new_owner);
+        __atomic_fetch_add(&(this->migrations), 1, __ATOMIC_RELAXED);
+    }
+}
+
+
+unsigned int EventEngine::serve_rx(EngineWorker *worker, EnginePort *port)
+{
+    u_int64_t start = mono_ns();
+    int frames = port_poll(port->tdata, ENGINE_RX_BUDGET);
+    u_int64_t busy = mono_ns() - start;
+
+    if (frames < 0) {
+        // End of input trace
+        port->done = true;
+        __atomic_fetch_sub(&(this->replays), 1, __ATOMIC_RELEASE);
+        frames = 0;
+    }
+    __atomic_store_n(&(port->busy_ns), port->busy_ns + busy, __ATOMIC_RELAXED);
+    __atomic_store_n(&(worker->busy_ns), worker->busy_ns + busy, __ATOMIC_RELAXED);
+    __atomic_store_n(&(worker->frames), worker->frames + frames, __ATOMIC_RELAXED);
+    return frames;
+}
+
+
+bool EventEngine::tx_pending(EngineWorker *worker)
+{
+    for (size_t i=0; i < worker->owned.size(); i++) {
+        if (worker->owned[i]->tdata->worker == 0 && worker->owned[i]->tdata->port->queue->depth()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+void EventEngine::wake(EngineWorker *worker)
+{
+    u_int64_t one = 1;
+    ssize_t ret = write(worker->wake_fd, &one, sizeof(one));
+    (void) ret;     // eventfd fails only on counter overflow, the worker is awake then
+}
+
+
+void EventEngine::run(EngineWorker *worker)
+{
+    struct epoll_event events[ENGINE_MAX_EVENTS];
+    bool receiving = true;
+    int timeout = 0;
+
+    rcu_register();
+    while (1) {
+        adopt(worker);
+        hand_over(worker);
+        if (receiving && __atomic_load_n(&(this->stopping), __ATOMIC_ACQUIRE)) {
+            receiving = false;
+            __atomic_fetch_add(&(this->rx_stopped), 1, __ATOMIC_ACQ_REL);
+            timeout = 0;
+        }
+
+        if (timeout) {
+            // Pairs with EgressQueue::wakeup() - either the producer sees
+            // the flag or we see its frames
+            rcu_quiescent();
+            __atomic_store_n(&(worker->sleeping), 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (tx_pending(worker)) {
+                timeout = 0;
+            }
+        }
+        int n = epoll_wait(worker->epfd, events, ENGINE_MAX_EVENTS, timeout);
+        __atomic_store_n(&(worker->sleeping), 0, __ATOMIC_RELAXED);
+        if (n < 0) {
+            if (errno != EINTR) {
+                perror("epoll_wait()");
+            }
+            n = 0;
+        }
+        if (timeout && n > 0) {
+            worker->wakeups++;
+        }
+
+        unsigned int work = 0;
+        for (int i=0; i < n; i++) {
+            EnginePort *port = (EnginePort *) events[i].data.ptr;
+            if (!port) {
+                u_int64_t val;
+                ssize_t ret = read(worker->wake_fd, &val, sizeof(val));
+                (void) ret;
+                continue;
+            }
+            if (receiving) {
+                work += serve_rx(worker, port);
+            }
+        }
+
+        for (size_t i=0; i < worker->owned.size(); i++) {
+            EnginePort *port = worker->owned[i];
+            if (port->fd < 0 && !port->done && receiving) {
+                work += serve_rx(worker, port);
+            }
+            Port *out = port->tdata->port;
+            if (port->tdata->worker == 0 && out->queue->depth()) {
+                u_int64_t start = mono_ns();
+                work += out->tx_poll(ENGINE_TX_BUDGET);
+                u_int64_t busy = mono_ns() - start;
+                __atomic_store_n(&(port->busy_ns), port->busy_ns + busy, __ATOMIC_RELAXED);
+                __atomic_store_n(&(worker->busy_ns), worker->busy_ns + busy, __ATOMIC_RELAXED);
+            }
+        }
+
+        if (!receiving && !work && !tx_pending(worker)
+            && __atomic_load_n(&(this->rx_stopped), __ATOMIC_ACQUIRE) == this->workers.size()) {
+            // Nobody produces frames any more and own queues are drained,
+            // a ring handed over before the others stopped is still served
+            pthread_mutex_lock(&(worker->mutex));
+            bool incoming = !worker->incoming.empty();
+            pthread_mutex_unlock(&(worker->mutex));
+            if (!incoming) {
+                break;
+            }
+        }
+        timeout = work ? 0 : (receiving ? ENGINE_POLL_MS : 1);
+    }
+    rcu_unregister();
+}
+
+
+// Moves one ring per round from the busiest worker to the least loaded
+// one, only a ring whose load is smaller than the difference (the move
+// lowers the maximum and can't just swap the roles of the workers)
+void EventEngine::rebalance()
+{
+    if (this->workers.size() < 2 || __atomic_load_n(&(this->stopping), __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    u_int32_t now = coarse_time();
+    if (now - this->last_rebalance < ENGINE_REBALANCE_INTERVAL) {
+        return;
+    }
+    this->last_rebalance = now;
+
+    vector<u_int64_t> load(this->workers.size(), 0);
+    vector<u_int64_t> delta(this->ports.size(), 0);
+    vector<int> owner(this->ports.size(), -1);
+    bool moving = false;
+    for (size_t i=0; i < this->ports.size(); i++) {
+        EnginePort *port = this->ports[i];
+        u_int64_t busy = __atomic_load_n(&(port->busy_ns), __ATOMIC_RELAXED);
+        delta[i] = busy - port->round_busy_ns;
+        port->round_busy_ns = busy;
+        owner[i] = __atomic_load_n(&(port->owner), __ATOMIC_ACQUIRE);
+        if (owner[i] < 0 || __atomic_load_n(&(port->move_to), __ATOMIC_RELAXED) >= 0) {
+            moving = true;
+            continue;
+        }
+        load[owner[i]] += delta[i];
+    }
+    if (moving) {
+        // Previous move isn't finished
+        return;
+    }
+
+    size_t busiest = 0, idlest = 0;
+    u_int64_t total = 0;
+    for (size_t i=0; i < load.size(); i++) {
+        total += load[i];
+        if (load[i] > load[busiest]) {
+            busiest = i;
+        }
+        if (load[i] < load[idlest]) {
+            idlest = i;
+        }
+    }
+    if (load[busiest] < ENGINE_MIN_BUSY_US * 1000ULL
+        || load[busiest] * 100 * load.size() < total * ENGINE_SKEW_PCT) {
+        return;
+    }
+
+    int best = -1;
+    for (size_t i=0; i < this->ports.size(); i++) {
+        if (owner[i] == (int) busiest && delta[i] < load[busiest] - load[idlest]
+            && (best < 0 || delta[i] > delta[best])) {
+            best = i;
+        }
+    }
+    if (best >= 0) {
+        __atomic_store_n(&(this->ports[best]->move_to), (int) idlest, __ATOMIC_RELEASE);
+        wake(this->workers[busiest]);
+    }
+}
+
+
+void EventEngine::wait_replay()
+{
+    while (__atomic_load_n(&(this->replays), __ATOMIC_ACQUIRE)) {
+        usleep(1000);
+    }
+}
+
+
+void EventEngine::stop()
+{
+    __atomic_store_n(&(this->stopping), 1, __ATOMIC_RELEASE);
+    for (size_t i=0; i < this->workers.size(); i++) {
+        wake(this->workers[i]);
+    }
+    for (size_t i=0; i < this->workers.size(); i++) {
+        int ret = pthread_join(this->workers[i]->thread, NULL);
+        if (ret) {
+            fprintf(stderr, "pthread_join() err %d\n", ret);
+        }
+    }
+    // Egress queues outlive the workers
+    for (size_t i=0; i < this->ports.size(); i++) {
+        if (this->ports[i]->tdata->worker == 0) {
+            this->ports[i]->tdata->port->queue->set_notify(NULL, -1);
+        }
+    }
+}
+
+
+void EventEngine::print_stat()
+{
+    printf("Engine\tCPU\tRings\tFrames\tBusy-ms\tWakeups\n");
+    for (size_t i=0; i < this->workers.size(); i++) {
+        EngineWorker *worker = this->workers[i];
+        unsigned int rings = 0;
+        for (size_t j=0; j < this->ports.size(); j++) {
+            rings += __atomic_load_n(&(this->ports[j]->owner), __ATOMIC_RELAXED) == (int) i;
+        }
+        char cpu[16] = "-";
+        if (worker->cpu >= 0) {
+            snprintf(cpu, sizeof(cpu), "%d", worker->cpu);
+        }
+        printf("worker%zu\t%s\t%u\t%llu\t%.1f\t%llu\n", i, cpu, rings,
+               (unsigned long long) __atomic_load_n(&(worker->frames), __ATOMIC_RELAXED),
+               __atomic_load_n(&(worker->busy_ns), __ATOMIC_RELAXED) / 1e6,
+               (unsigned long long) __atomic_load_n(&(worker->wakeups), __ATOMIC_RELAXED));
+    }
+    printf("Ring migrations: %zu\n", __atomic_load_n(&(this->migrations), __ATOMIC_RELAXED));
+}
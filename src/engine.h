@@ -0,0 +1,88 @@
+#ifndef __SWITCH_ENGINE_H__
+#define __SWITCH_ENGINE_H__
+
+#include <vector>
+#include <pthread.h>
+#include "port_thread.h"
+#include "placement.h"
+
+#define ENGINE_MAX_EVENTS       64
+#define ENGINE_RX_BUDGET        8       // ring blocks (bursts) taken from one ring at once
+#define ENGINE_TX_BUDGET        256     // frames transmitted to one port at once
+#define ENGINE_POLL_MS          100     // max sleep of idle worker
+#define ENGINE_REBALANCE_INTERVAL 2     // s between rebalancing rounds
+#define ENGINE_SKEW_PCT         150     // load of busiest worker over average (%) which moves a ring
+#define ENGINE_MIN_BUSY_US      10000   // busiest worker below this load per round is left alone
+
+
+// Receive ring served by an engine worker. Owner of the first ring of a
+// port serves also the egress queue of the port.
+class EnginePort {
+    public:
+        PortThreadData *tdata;
+        int fd;                 // signals received frames, -1 = polled in every loop (file port)
+        int owner;              // worker serving the ring, -1 while handed over
+        int move_to;            // worker the ring goes to, -1 = stays
+        bool done;              // end of input trace reached
+        u_int64_t busy_ns;      // processing time, written by owner
+        u_int64_t round_busy_ns;    // busy_ns at last rebalancing (rebalancer only)
+};
+
+
+class EventEngine;
+
+
+class EngineWorker {
+    public:
+        EventEngine *engine;
+        unsigned int index;
+        int epfd;
+        int wake_fd;            // eventfd, written by egress queue producers and on hand over
+        int sleeping;           // worker is (going) in epoll_wait()
+        int cpu;
+        pthread_t thread;
+        std::vector<EnginePort*> owned;     // touched only by the worker
+        pthread_mutex_t mutex;
+        std::vector<EnginePort*> incoming;  // rings handed over to the worker, protected by mutex
+        u_int64_t frames;       // frames taken from rings (outgoing ones too)
+        u_int64_t busy_ns;
+        u_int64_t wakeups;      // returns from sleeping epoll_wait()
+};
+
+
+// Alternative threading model - a fixed pool of workers serves all ports.
+// Every worker multiplexes receive rings and egress queues of its ports by
+// epoll, so many lightly loaded interfaces don't cost a thread pair each.
+// Rings are moved from the busiest to the least loaded worker when the
+// processing time is skewed; the old owner removes the ring from its epoll
+// set before the new one adds it, so a ring has one owner at any time.
+class EventEngine {
+    private:
+        std::vector<EngineWorker*> workers;
+        std::vector<EnginePort*> ports;
+        int stopping;
+        unsigned int rx_stopped;    // workers which don't receive any more
+        unsigned int replays;       // input traces not finished yet
+        u_int32_t last_rebalance;
+
+        void adopt(EngineWorker *worker);
+        void hand_over(EngineWorker *worker);
+        unsigned int serve_rx(EngineWorker *worker, EnginePort *port);
+        bool tx_pending(EngineWorker *worker);
+        void wake(EngineWorker *worker);
+
+    public:
+        size_t migrations;
+
+        EventEngine(unsigned int workers);
+        ~EventEngine();
+        // Workers are started with the rings of threads assigned round robin
+        int start(std::vector<PortThreadData*> &threads, Placement &placement, pthread_attr_t *attr);
+        void run(EngineWorker *worker);     // worker loop
+        void rebalance();                   // called periodically by aging thread
+        void wait_replay();                 // returns when all input traces are processed
+        void stop();                        // after Port::stop(), returns when egress queues are drained
+        void print_stat();
+};
+
+#endif /* __SWITCH_ENGINE_H__ */
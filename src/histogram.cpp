@@ -0,0 +1,96 @@
+#include <cstdio>
+#include <string.h>
+#include "histogram.h"
+
+int hist_enabled = 0;
+
+
+LatencyHistogram::LatencyHistogram()
+{
+    clear();
+}
+
+
+u_int64_t LatencyHistogram::bucket_low(unsigned int index)
+{
+    if (index < 2 * HIST_SUB_BUCKETS) {
+        return index;
+    }
+    unsigned int exp = index / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+    u_int64_t mantissa = index % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS;
+    return mantissa << (exp - HIST_SUB_BITS);
+}
+
+
+void LatencyHistogram::add(const LatencyHistogram &other)
+{
+    for (unsigned int i=0; i < HIST_BUCKETS; i++) {
+        this->counts[i] += __atomic_load_n(&(other.counts[i]), __ATOMIC_RELAXED);
+    }
+}
+
+
+void LatencyHistogram::subtract(const LatencyHistogram &base)
+{
+    for (unsigned int i=0; i < HIST_BUCKETS; i++) {
+        this->counts[i] -= base.counts[i];
+    }
+}
+
+
+void LatencyHistogram::clear()
+{
+    memset(this->counts, 0, sizeof(this->counts));
+}
+
+
+u_int64_t LatencyHistogram::total() const
+{
+    u_int64_t sum = 0;
+    for (unsigned int i=0; i < HIST_BUCKETS; i++) {
+        sum += this->counts[i];
+    }
+    return sum;
+}
+
+
+u_int64_t LatencyHistogram::percentile(double pct) const
+{
+    u_int64_t count = total();
+    if (!count) {
+        return 0;
+    }
+
+    // Rank of the value, at least the first one
+    u_int64_t rank = (u_int64_t) (count * pct / 100.0 + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    u_int64_t sum = 0;
+    for (unsigned int i=0; i < HIST_BUCKETS; i++) {
+        sum += this->counts[i];
+        if (sum >= rank) {
+            return bucket_high(i);
+        }
+    }
+    return bucket_high(HIST_BUCKETS - 1);
+}
+
+
+u_int64_t LatencyHistogram::max() const
+{
+    for (int i=HIST_BUCKETS - 1; i >= 0; i--) {
+        if (this->counts[i]) {
+            return bucket_high(i);
+        }
+    }
+    return 0;
+}
+
+
+void print_histogram(const char *name, const LatencyHistogram &hist)
+{
+    printf("%-20s %12llu %10.3f %10.3f %10.3f %10.3f\n", name, (unsigned long long) hist.total(),
+           hist.percentile(50) / 1000.0, hist.percentile(99) / 1000.0,
+           hist.percentile(99.9) / 1000.0, hist.max() / 1000.0);
+}
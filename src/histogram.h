@@ -0,0 +1,65 @@
+#ifndef __SWITCH_HISTOGRAM_H__
+#define __SWITCH_HISTOGRAM_H__
+
+#include <sys/types.h>
+
+#ifndef LATENCY_HIST
+#define LATENCY_HIST        1       // 0 compiles the instrumentation out (make HIST=0)
+#endif
+
+#define HIST_SUB_BITS       4       // 16 linear sub-buckets per power of two (max error 6 %)
+#define HIST_SUB_BUCKETS    (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS       40      // values from 2^40 ns (18 min) up share the last bucket
+#define HIST_BUCKETS        ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+
+extern int hist_enabled;    // runtime switch (-H, command lat on/off)
+
+static inline bool hist_on()
+{
+    return LATENCY_HIST && __atomic_load_n(&hist_enabled, __ATOMIC_RELAXED);
+}
+
+
+// Log-linear (HDR style) histogram of times in ns with a single writer
+// thread. Values below 2 * HIST_SUB_BUCKETS are exact, every power of two
+// above is split into HIST_SUB_BUCKETS equal buckets. Writer does plain
+// load + store like PortCounter, readers merge copies at any time.
+class LatencyHistogram {
+    public:
+        u_int64_t counts[HIST_BUCKETS];
+
+        LatencyHistogram();
+
+        static unsigned int bucket(u_int64_t ns)
+        {
+            if (ns < 2 * HIST_SUB_BUCKETS) {
+                return ns;
+            }
+            unsigned int exp = 63 - __builtin_clzll(ns);
+            if (exp >= HIST_MAX_BITS) {
+                return HIST_BUCKETS - 1;
+            }
+            return (exp - HIST_SUB_BITS) * HIST_SUB_BUCKETS + (ns >> (exp - HIST_SUB_BITS));
+        }
+        static u_int64_t bucket_low(unsigned int index);
+        static u_int64_t bucket_high(unsigned int index) { return bucket_low(index + 1) - 1; }
+
+        void record(u_int64_t ns, u_int64_t count = 1)
+        {
+            u_int64_t *slot = &(this->counts[bucket(ns)]);
+            __atomic_store_n(slot, __atomic_load_n(slot, __ATOMIC_RELAXED) + count, __ATOMIC_RELAXED);
+        }
+        void add(const LatencyHistogram &other);        // merge counts of other thread
+        void subtract(const LatencyHistogram &base);    // counts recorded since base was taken
+        void clear();
+        u_int64_t total() const;
+        u_int64_t percentile(double pct) const;         // upper bound of the bucket, 0 if empty
+        u_int64_t max() const;
+} __attribute__((aligned(64)));
+
+
+// One line of the lat command: count, p50, p99, p99.9 and max in us
+void print_histogram(const char *name, const LatencyHistogram &hist);
+
+#endif /* __SWITCH_HISTOGRAM_H__ */
@@ -1,5 +1,8 @@
+#include <new>
+#include <string.h>
 #include <pcap.h>
 #include <cstdio>
+#include <stdlib.h>
 #include <assert.h>
 #include <linux/if_ether.h>
 #include <linux/ip.h>
@@ -7,19 +10,52 @@
 #include <arpa/inet.h>
 #include "igmp.h"
 #include "camtable.h"
+#include "rcu.h"
 
 
 #define IGMP_PROTOCOL   2
+#define IGMP_LAST_MEMBER_RESP   10  // max response time of own group specific query (1/10 s)
+
+// Aging timer id: group address in high bits, port index + 1 in low 16 bits (0 = group timer)
+#define IGMP_TIMER_ID(group_id, port) (((u_int64_t) (group_id) << 16) | ((port) ? (port)->index + 1 : 0))
+
+
+// Bit of port in membership bitmaps, ports over IGMP_MAX_PORTS have none
+static inline u_int64_t port_bit(Port *port)
+{
+    return (port && port->index < IGMP_MAX_PORTS) ? (1ULL << port->index) : 0;
+}
+
+
+static inline size_t group_hash(__be32 group_id)
+{
+    return ((u_int32_t) group_id * 0x9e3779b1U) >> 8;
+}
 
 
 IgmpTable::IgmpTable()
 {
     pthread_mutex_init(&(this->mutex), NULL);
+    this->groups = alloc_groups(IGMP_GROUP_SLOTS);
+    this->macs = mcast_mac_alloc(MCAST_MAC_SLOTS);
+    this->queriers = 0;
+    this->mac_fast_path = true;
+    this->pool = NULL;
+    this->proxy_reporting = false;
+    this->reports_forwarded = 0;
+    this->reports_suppressed = 0;
 }
 
 
 IgmpTable::~IgmpTable()
 {
+    for (size_t i=0; i <= this->groups->mask; i++) {
+        GroupSlot *slot = &(this->groups->slots[i]);
+        delete slot->record;
+        free(slot->snap);
+    }
+    free(this->groups);
+    free(this->macs);
     pthread_mutex_destroy(&(this->mutex));
 }
 
@@ -27,6 +63,308 @@ IgmpTable::~IgmpTable()
 void IgmpTable::set_ports(vector<Port*> ports)
 {
     this->ports = ports;
+    if (ports.size() > IGMP_MAX_PORTS) {
+        fprintf(stderr, "IGMP snooping works only on first %d ports\n", IGMP_MAX_PORTS);
+    }
+}
+
+
+void IgmpTable::set_pool(PacketPool *pool)
+{
+    this->pool = pool;
+}
+
+
+GroupTable *IgmpTable::alloc_groups(size_t slots)
+{
+    GroupTable *table = (GroupTable *) calloc(1, sizeof(GroupTable) + slots * sizeof(GroupSlot));
+    if (!table) {
+        throw std::bad_alloc();
+    }
+    table->mask = slots - 1;
+    return table;
+}
+
+
+// Lock free, table is either current table or a retired one still
+// protected by RCU
+GroupSlot *IgmpTable::find_slot(GroupTable *table, __be32 group_id)
+{
+    size_t i = group_hash(group_id) & table->mask;
+    while (1) {
+        GroupSlot *slot = &(table->slots[i]);
+        int state = __atomic_load_n(&(slot->state), __ATOMIC_ACQUIRE);
+        if (state == GROUP_SLOT_EMPTY) {
+            return NULL;
+        }
+        if (slot->group_id == group_id) {
+            return slot;
+        }
+        i = (i + 1) & table->mask;
+    }
+}
+
+
+// Caller holds the mutex
+IgmpRecord *IgmpTable::find_record(__be32 group_id)
+{
+    GroupSlot *slot = find_slot(this->groups, group_id);
+    if (slot && slot->state == GROUP_SLOT_USED) {
+        return slot->record;
+    }
+    return NULL;
+}
+
+
+// Caller holds the mutex. New group has no members and no querier.
+IgmpRecord *IgmpTable::create_record(__be32 group_id)
+{
+    IgmpRecord *irc = new IgmpRecord;
+    irc->group_id = group_id;
+    irc->igmp_querier = NULL;
+    irc->ports = 0;
+    irc->group_timer = 0;
+
+    GroupSlot *slot = find_slot(this->groups, group_id);
+    if (slot) {
+        // Deleted slot of the same group
+        slot->record = irc;
+        __atomic_store_n(&(slot->state), GROUP_SLOT_USED, __ATOMIC_RELEASE);
+        this->groups->deleted--;
+        this->groups->used++;
+        update_mac(group_id);
+        return irc;
+    }
+
+    size_t size = this->groups->mask + 1;
+    if ((this->groups->used + this->groups->deleted + 1) * 4 > size * 3) {
+        // Drop deleted slots, grow if live groups take more than half
+        rebuild_groups((this->groups->used + 1) * 2 > size ? size * 2 : size);
+    }
+
+    size_t i = group_hash(group_id) & this->groups->mask;
+    while (this->groups->slots[i].state != GROUP_SLOT_EMPTY) {
+        i = (i + 1) & this->groups->mask;
+    }
+    slot = &(this->groups->slots[i]);
+    slot->group_id = group_id;
+    slot->record = irc;
+    slot->snap = NULL;
+    __atomic_store_n(&(slot->state), GROUP_SLOT_USED, __ATOMIC_RELEASE);
+    this->groups->used++;
+    update_mac(group_id);
+    return irc;
+}
+
+
+// Caller holds the mutex
+void IgmpTable::remove_record(IgmpRecord *irc)
+{
+    GroupSlot *slot = find_slot(this->groups, irc->group_id);
+    assert(slot && slot->record == irc);
+
+    GroupSnapshot *old = __atomic_exchange_n(&(slot->snap), (GroupSnapshot *) NULL, __ATOMIC_ACQ_REL);
+    if (old) {
+        rcu_retire(old, free);
+    }
+    slot->record = NULL;
+    __atomic_store_n(&(slot->state), GROUP_SLOT_DELETED, __ATOMIC_RELEASE);
+    this->groups->used--;
+    this->groups->deleted++;
+    __be32 group_id = irc->group_id;
+    delete irc;
+    update_mac(group_id);
+}
+
+
+// Caller holds the mutex. Live groups (with their snapshots) move to a new
+// table, readers may still walk the old one until it is reclaimed.
+void IgmpTable::rebuild_groups(size_t slots)
+{
+    GroupTable *old = this->groups;
+    GroupTable *table = alloc_groups(slots);
+
+    for (size_t i=0; i <= old->mask; i++) {
+        GroupSlot *slot = &(old->slots[i]);
+        if (slot->state != GROUP_SLOT_USED) {
+            continue;
+        }
+        size_t j = group_hash(slot->group_id) & table->mask;
+        while (table->slots[j].state != GROUP_SLOT_EMPTY) {
+            j = (j + 1) & table->mask;
+        }
+        table->slots[j] = *slot;
+        table->used++;
+    }
+
+    __atomic_store_n(&(this->groups), table, __ATOMIC_RELEASE);
+    rcu_retire(old, free);
+}
+
+
+// Caller holds the mutex. Replaces the data plane view of the group.
+void IgmpTable::publish(IgmpRecord *irc)
+{
+    GroupSnapshot *snap = NULL;
+    if (irc->ports) {
+        // Per source masks of all source filtering members
+        map<__be32, SourceMask> masks;
+        u_int64_t exclude = irc->ports;
+        map<unsigned int, IgmpFilter>::iterator it;
+        for (it = irc->filters.begin(); it != irc->filters.end(); it++) {
+            u_int64_t bit = 1ULL << it->first;
+            if (!it->second.exclude) {
+                exclude &= ~bit;
+            }
+            for (set<__be32>::iterator src = it->second.sources.begin(); src != it->second.sources.end(); src++) {
+                SourceMask &mask = masks[*src];
+                mask.source = *src;
+                if (it->second.exclude) {
+                    mask.exclude |= bit;
+                } else {
+                    mask.include |= bit;
+                }
+            }
+        }
+
+        snap = (GroupSnapshot *) malloc(sizeof(GroupSnapshot) + masks.size() * sizeof(SourceMask));
+        if (!snap) {
+            throw std::bad_alloc();
+        }
+        snap->group_id = irc->group_id;
+        snap->ports = irc->ports;
+        snap->exclude = exclude;
+        snap->nsources = 0;
+        for (map<__be32, SourceMask>::iterator m = masks.begin(); m != masks.end(); m++) {
+            snap->sources[snap->nsources++] = m->second;
+        }
+    }
+
+    GroupSlot *slot = find_slot(this->groups, irc->group_id);
+    GroupSnapshot *old = __atomic_exchange_n(&(slot->snap), snap, __ATOMIC_ACQ_REL);
+    if (old) {
+        rcu_retire(old, free);
+    }
+    update_mac(irc->group_id);
+}
+
+
+McastMacTable *mcast_mac_alloc(size_t slots)
+{
+    McastMacTable *table = (McastMacTable *) calloc(1, sizeof(McastMacTable) + slots * sizeof(McastMacEntry));
+    if (!table) {
+        throw std::bad_alloc();
+    }
+    table->mask = slots - 1;
+    return table;
+}
+
+
+McastMacEntry *mcast_mac_find(McastMacTable *table, u_int32_t mac)
+{
+    size_t i = group_hash(mac) & table->mask;
+    while (1) {
+        McastMacEntry *entry = &(table->entries[i]);
+        if (__atomic_load_n(&(entry->state), __ATOMIC_ACQUIRE) == MAC_ENTRY_EMPTY) {
+            return NULL;
+        }
+        if (entry->mac == mac) {
+            return entry;
+        }
+        i = (i + 1) & table->mask;
+    }
+}
+
+
+McastMacEntry *mcast_mac_insert(McastMacTable **table, u_int32_t mac)
+{
+    McastMacTable *old = *table;
+    size_t size = old->mask + 1;
+    if ((old->used + 1) * 4 > size * 3) {
+        // Rebuild without MACs no group maps to
+        size_t live = 0;
+        for (size_t i=0; i <= old->mask; i++) {
+            if (old->entries[i].state != MAC_ENTRY_EMPTY && old->entries[i].state != MAC_ENTRY_NONE) {
+                live++;
+            }
+        }
+        McastMacTable *rebuilt = mcast_mac_alloc((live + 1) * 2 > size ? size * 2 : size);
+        for (size_t i=0; i <= old->mask; i++) {
+            if (old->entries[i].state == MAC_ENTRY_EMPTY || old->entries[i].state == MAC_ENTRY_NONE) {
+                continue;
+            }
+            size_t j = group_hash(old->entries[i].mac) & rebuilt->mask;
+            while (rebuilt->entries[j].state != MAC_ENTRY_EMPTY) {
+                j = (j + 1) & rebuilt->mask;
+            }
+            rebuilt->entries[j] = old->entries[i];
+            rebuilt->used++;
+        }
+        __atomic_store_n(table, rebuilt, __ATOMIC_RELEASE);
+        rcu_retire(old, free);
+    }
+
+    McastMacTable *cur = *table;
+    size_t i = group_hash(mac) & cur->mask;
+    while (cur->entries[i].state != MAC_ENTRY_EMPTY) {
+        i = (i + 1) & cur->mask;
+    }
+    McastMacEntry *entry = &(cur->entries[i]);
+    entry->mac = mac;
+    __atomic_store_n(&(entry->state), MAC_ENTRY_NONE, __ATOMIC_RELEASE);
+    cur->used++;
+    return entry;
+}
+
+
+// Caller holds the mutex. Recomputes the MAC entry of group from all
+// groups mapped to the same MAC. Only a MAC with a single known group is
+// forwarded by the MAC, traffic to the other groups sharing it may go
+// elsewhere (or nowhere).
+void IgmpTable::update_mac(__be32 group_id)
+{
+    u_int32_t mac = group_id & MCAST_MAC_MASK;
+    u_int64_t ports = 0;
+    __be32 group = 0;
+    int records = 0;    // known groups mapped to the MAC
+    int groups = 0;     // of them with members
+    bool filtered = false;
+
+    for (u_int32_t high=0; high < 32; high++) {
+        IgmpRecord *irc = find_record(0xe0000000 | (high << 23) | mac);
+        if (!irc) {
+            continue;
+        }
+        records++;
+        if (irc->ports) {
+            ports = irc->ports;
+            group = irc->group_id;
+            groups++;
+            if (!irc->filters.empty()) {
+                // Source filters need the IP header too
+                filtered = true;
+            }
+        }
+    }
+
+    McastMacEntry *entry = mcast_mac_find(this->macs, mac);
+    if (!entry) {
+        if (!groups) {
+            return;
+        }
+        entry = mcast_mac_insert(&(this->macs), mac);
+    }
+
+    // Readers check state first - ports are written before the entry becomes usable
+    if (!groups) {
+        __atomic_store_n(&(entry->state), MAC_ENTRY_NONE, __ATOMIC_RELEASE);
+    } else if (records > 1 || filtered) {
+        __atomic_store_n(&(entry->state), MAC_ENTRY_AMBIGUOUS, __ATOMIC_RELEASE);
+    } else {
+        __atomic_store_n(&(entry->group), htonl(group), __ATOMIC_RELAXED);
+        __atomic_store_n(&(entry->ports), ports, __ATOMIC_RELAXED);
+        __atomic_store_n(&(entry->state), MAC_ENTRY_PORTS, __ATOMIC_RELEASE);
+    }
 }
 
 
@@ -36,13 +374,10 @@ void IgmpTable::add_group(__be32 group_id)
         return;
 
 
-    pthread_mutex_lock(&(this->mutex));
-    if(!this->records.count(group_id)) {
-        IgmpRecord *irc = new IgmpRecord;
-        irc->group_id = group_id;
-        irc->igmp_querier = NULL;
-        
-        this->records[group_id] = irc;
+    lock_acquire(&(this->mutex), &(this->lock_stat));
+    if (!find_record(group_id)) {
+        IgmpRecord *irc = create_record(group_id);
+        arm_group_timer(irc, coarse_time());
     }
     pthread_mutex_unlock(&(this->mutex));
 }
@@ -54,21 +389,16 @@ void IgmpTable::add_or_update_group(__be32 group_id, Port *port)
         return;
 
 
-    IgmpRecordTable::iterator it;
-    pthread_mutex_lock(&(this->mutex));
-    it = this->records.find(group_id);
+    lock_acquire(&(this->mutex), &(this->lock_stat));
+    IgmpRecord *irc = find_record(group_id);
 
-    if(it == this->records.end()) {
+    if (irc == NULL) {
         // Group doesn't exists yet
-        IgmpRecord *irc = new IgmpRecord;
-        irc->group_id = group_id;
-        irc->igmp_querier = port;
-        this->records[group_id] = irc;
-    } else {
-        // Group already exists - update querier
-        IgmpRecord *irc = (IgmpRecord *) it->second;
-        irc->igmp_querier = port;
+        irc = create_record(group_id);
+        arm_group_timer(irc, coarse_time());
     }
+    // Update querier
+    irc->igmp_querier = port;
 
     pthread_mutex_unlock(&(this->mutex));
 }
@@ -76,34 +406,31 @@ void IgmpTable::add_or_update_group(__be32 group_id, Port *port)
 
 void IgmpTable::add_group_member(__be32 group_id, Port *port)
 {
-    if (group_id == 0)
+    u_int64_t bit = port_bit(port);
+    if (group_id == 0 || bit == 0)
         return;
 
-    IgmpRecordTable::iterator it;
-    pthread_mutex_lock(&(this->mutex));
-    it = this->records.find(group_id);
+    lock_acquire(&(this->mutex), &(this->lock_stat));
+    IgmpRecord *irc = find_record(group_id);
 
-    if (it == this->records.end()) {
+    if (irc == NULL) {
         // Unknown group
         pthread_mutex_unlock(&(this->mutex));
         return;
     }
-    
+
     // Add multicast group member or refresh if exists
-    
-    bool found = false;
-    IgmpRecord *irc = (IgmpRecord *) it->second;
-    for (unsigned int i=0; i < irc->ports.size(); i++) {
-        if (irc->ports[i] == port) {
-            irc->last_used_vector[i] = time(NULL);
-            found = true;
-            break;
-        }
-    }
-    
-    if (!found) {
-        irc->ports.push_back(port);
-        irc->last_used_vector.push_back(time(NULL));
+
+    u_int32_t now = coarse_time();
+    irc->last_used[port->index] = now;
+    if (!(irc->ports & bit)) {
+        irc->ports |= bit;
+        irc->timer[port->index] = now + IGMP_PORT_TIMEOUT + 1;
+        this->wheel.add(IGMP_TIMER_ID(group_id, port), irc->timer[port->index]);
+        publish(irc);
+    } else if (irc->filters.erase(port->index)) {
+        // IGMPv2 report - member wants all sources
+        publish(irc);
     }
 
     pthread_mutex_unlock(&(this->mutex));
@@ -113,43 +440,63 @@ void IgmpTable::add_group_member(__be32 group_id, Port *port)
 
 void IgmpTable::add_querier(Port *port)
 {
-    bool found = false;
-    for (size_t i=0; i < this->queriers.size(); i++) {
-        if (this->queriers[i] == port) {
-            found = true;
-        }
-    }
-    
-    if (!found) {
+    u_int64_t bit = port_bit(port);
+    if (bit && !(__atomic_load_n(&(this->queriers), __ATOMIC_RELAXED) & bit)) {
         // Add new querier
-        this->queriers.push_back(port);
+        __atomic_fetch_or(&(this->queriers), bit, __ATOMIC_RELAXED);
     }
 }
 
 
+// Caller holds the mutex
+void IgmpTable::remove_member(IgmpRecord *irc, unsigned int index)
+{
+    irc->ports &= ~(1ULL << index);
+    irc->filters.erase(index);
+    publish(irc);
+}
+
+
+// Caller holds the mutex. Fast leave port is pruned at once, other ports
+// get a group specific query and stay members only if a report comes
+// within IGMP_LAST_MEMBER_TIME.
+void IgmpTable::leave_member(IgmpRecord *irc, Port *port)
+{
+    if (port->fast_leave) {
+        remove_member(irc, port->index);
+        return;
+    }
+
+    // Member expires as if its last report came IGMP_LAST_MEMBER_TIME before timeout
+    u_int32_t now = coarse_time();
+    irc->last_used[port->index] = now - IGMP_PORT_TIMEOUT + IGMP_LAST_MEMBER_TIME;
+    irc->timer[port->index] = now + IGMP_LAST_MEMBER_TIME + 1;
+    this->wheel.add(IGMP_TIMER_ID(irc->group_id, port), irc->timer[port->index]);
+    send_igmp(IGMP_HOST_MEMBERSHIP_QUERY, irc->group_id, port_bit(port));
+}
+
+
 void IgmpTable::remove_group_member(__be32 group_id, Port *port)
 {
     if (group_id == 0)
         return;
 
-    IgmpRecordTable::iterator it;
-    pthread_mutex_lock(&(this->mutex));
-    it = this->records.find(group_id);
-    
-    if (it == this->records.end()) {
+    lock_acquire(&(this->mutex), &(this->lock_stat));
+    IgmpRecord *irc = find_record(group_id);
+
+    if (irc == NULL) {
         // Unknown group
         pthread_mutex_unlock(&(this->mutex));
         return;
     }
 
 	// Remove group member
-    IgmpRecord *irc = (IgmpRecord *) it->second;
-    for (unsigned int i=0; i < irc->ports.size(); i++) {
-        if (irc->ports[i] == port) {
-            irc->ports.erase(irc->ports.begin() + i);
-            irc->last_used_vector.erase(irc->last_used_vector.begin() + i);
-            break;
-        }
+    if (irc->ports & port_bit(port)) {
+        leave_member(irc, port);
+    }
+
+    if (!irc->ports) {
+        arm_group_timer(irc, coarse_time());
     }
 
     pthread_mutex_unlock(&(this->mutex));
@@ -157,69 +504,148 @@ void IgmpTable::remove_group_member(__be32 group_id, Port *port)
 }
 
 
-int IgmpTable::send_to_group(__be32 group_id,  const u_char *packet, size_t size)
+u_int64_t IgmpTable::group_ports(__be32 group_id)
 {
-    IgmpRecordTable::iterator it;
-    pthread_mutex_lock(&(this->mutex));
-    it = this->records.find(group_id);
-    
-    assert(group_id != 0);
-    
-    if (it == this->records.end()) {
+    GroupTable *table = __atomic_load_n(&(this->groups), __ATOMIC_ACQUIRE);
+    GroupSlot *slot = find_slot(table, group_id);
+    if (!slot) {
         // Unknown group
+        return 0;
+    }
+    GroupSnapshot *snap = __atomic_load_n(&(slot->snap), __ATOMIC_ACQUIRE);
+    return snap ? snap->ports : 0;
+}
+
+
+// Port keeps its own filter given by its last report (ALLOW and BLOCK
+// records modify it). INCLUDE with no sources means the port left.
+void IgmpTable::apply_group_record(__be32 group_id, Port *port, int type, const __be32 *sources, unsigned int count)
+{
+    u_int64_t bit = port_bit(port);
+    if (group_id == 0 || bit == 0)
+        return;
+
+    lock_acquire(&(this->mutex), &(this->lock_stat));
+    IgmpRecord *irc = find_record(group_id);
+
+    // Filter of port before the record
+    IgmpFilter cur;
+    cur.exclude = irc && (irc->ports & bit);
+    if (irc && irc->filters.count(port->index)) {
+        cur = irc->filters[port->index];
+    }
+
+    IgmpFilter next;
+    switch (type) {
+        case IGMPV3_MODE_IS_INCLUDE:
+        case IGMPV3_CHANGE_TO_INCLUDE:
+            next.exclude = false;
+            next.sources.insert(sources, sources + count);
+            break;
+        case IGMPV3_MODE_IS_EXCLUDE:
+        case IGMPV3_CHANGE_TO_EXCLUDE:
+            next.exclude = true;
+            next.sources.insert(sources, sources + count);
+            break;
+        case IGMPV3_ALLOW_NEW_SOURCES:
+        case IGMPV3_BLOCK_OLD_SOURCES:
+            next = cur;
+            for (unsigned int i=0; i < count; i++) {
+                if (next.exclude == (type == IGMPV3_ALLOW_NEW_SOURCES)) {
+                    next.sources.erase(sources[i]);
+                } else {
+                    next.sources.insert(sources[i]);
+                }
+            }
+            break;
+        default:
+            // Unknown record type
+            pthread_mutex_unlock(&(this->mutex));
+            return;
+    }
+
+    u_int32_t now = coarse_time();
+    if (!next.exclude && next.sources.empty()) {
+        // Leave
+        if (irc && (irc->ports & bit)) {
+            leave_member(irc, port);
+            if (!irc->ports) {
+                arm_group_timer(irc, now);
+            }
+        }
         pthread_mutex_unlock(&(this->mutex));
-        return MULT_OK;
+        return;
     }
 
-	// Send packet to group members
-    IgmpRecord *irc = (IgmpRecord *) it->second;
-    for (unsigned int i=0; i < irc->ports.size(); i++) {
-        irc->ports[i]->send(packet, size);
+    if (irc == NULL) {
+        irc = create_record(group_id);
+    }
+    bool changed = cur.exclude != next.exclude || cur.sources != next.sources;
+    irc->last_used[port->index] = now;
+    if (!(irc->ports & bit)) {
+        irc->ports |= bit;
+        irc->timer[port->index] = now + IGMP_PORT_TIMEOUT + 1;
+        this->wheel.add(IGMP_TIMER_ID(group_id, port), irc->timer[port->index]);
+        changed = true;
+    }
+    if (changed) {
+        if (next.exclude && next.sources.empty()) {
+            irc->filters.erase(port->index);
+        } else {
+            irc->filters[port->index] = next;
+        }
+        publish(irc);
     }
 
     pthread_mutex_unlock(&(this->mutex));
-    return MULT_OK;
 }
 
 
-void IgmpTable::send_to_all_queriers(const u_char *packet, size_t size)
+u_int64_t IgmpTable::group_ports(__be32 group_id, __be32 source)
 {
-    for (size_t i=0; i < this->queriers.size(); i++) {
-        this->queriers[i]->send(packet, size);
+    GroupTable *table = __atomic_load_n(&(this->groups), __ATOMIC_ACQUIRE);
+    GroupSlot *slot = find_slot(table, group_id);
+    GroupSnapshot *snap = slot ? __atomic_load_n(&(slot->snap), __ATOMIC_ACQUIRE) : NULL;
+    if (!snap) {
+        // Unknown group or no members
+        return 0;
     }
+
+    // Binary search of the source
+    u_int32_t lo = 0, hi = snap->nsources;
+    while (lo < hi) {
+        u_int32_t mid = (lo + hi) / 2;
+        if (snap->sources[mid].source < source) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < snap->nsources && snap->sources[lo].source == source) {
+        return (snap->exclude & ~snap->sources[lo].exclude) | snap->sources[lo].include;
+    }
+    return snap->exclude;
 }
 
 
-int IgmpTable::send_to_querier(__be32 group_id,  const u_char *packet, size_t size)
+u_int64_t IgmpTable::querier_ports(__be32 group_id)
 {
-    IgmpRecordTable::iterator it;
-    pthread_mutex_lock(&(this->mutex));
-    it = this->records.find(group_id);
-    
-    assert(group_id != 0);
-    
-    if (it == this->records.end()) {
-        // Unknown group
-        send_to_all_queriers(packet, size);
-        pthread_mutex_unlock(&(this->mutex));
-        return MULT_OK;
-    }
+    u_int64_t ports;
 
-    // Send to querier
-    IgmpRecord *irc = (IgmpRecord *) it->second;
-    if (irc->igmp_querier != NULL) {
-        irc->igmp_querier->send(packet, size);
+    lock_acquire(&(this->mutex), &(this->lock_stat));
+    IgmpRecord *irc = find_record(group_id);
+    if (irc && irc->igmp_querier != NULL) {
+        // Querier of the group
+        ports = port_bit(irc->igmp_querier);
     } else {
-        // Querier is unknown for now
-        send_to_all_queriers(packet, size);
+        // Unknown group or querier is unknown for now
+        ports = __atomic_load_n(&(this->queriers), __ATOMIC_RELAXED);
     }
-
     pthread_mutex_unlock(&(this->mutex));
-    return MULT_OK;
+    return ports;
 }
 
 
-
 string IgmpTable::print_ip(int ip)
 {
     unsigned char bytes[4];
@@ -234,15 +660,187 @@ string IgmpTable::print_ip(int ip)
 }
 
 
-int IgmpTable::process_igmp_packet(Port *source_port, const u_char *packet, size_t size, struct igmphdr *igmp_hdr)
+// Group records are applied one by one, the report goes to queriers of all its groups
+int IgmpTable::process_igmpv3_report(Port *source_port, const u_int8_t *report, size_t len, u_int64_t *egress)
+{
+    const struct igmpv3_report *hdr = (const struct igmpv3_report *) report;
+    size_t off = sizeof(struct igmpv3_report);
+    vector<__be32> sources;
+
+    if (off > len) {
+        // Bad packet
+        return MULT_ERR;
+    }
+
+    for (unsigned int i=0; i < ntohs(hdr->ngrec); i++) {
+        const struct igmpv3_grec *grec = (const struct igmpv3_grec *) (report + off);
+        if (off + sizeof(struct igmpv3_grec) > len) {
+            return MULT_ERR;
+        }
+        unsigned int nsrcs = ntohs(grec->grec_nsrcs);
+        size_t rec_len = sizeof(struct igmpv3_grec) + nsrcs * sizeof(__be32) + grec->grec_auxwords * 4;
+        if (off + rec_len > len) {
+            return MULT_ERR;
+        }
+
+        sources.resize(nsrcs);
+        for (unsigned int j=0; j < nsrcs; j++) {
+            sources[j] = ntohl(grec->grec_src[j]);
+        }
+        __be32 group_id = ntohl(grec->grec_mca);
+        bool active = group_ports(group_id) != 0;
+        apply_group_record(group_id, source_port, grec->grec_type, nsrcs ? &sources[0] : NULL, nsrcs);
+        u_int64_t queriers = querier_ports(group_id);
+        report_upstream(group_id, active, &queriers);
+        *egress |= queriers;
+        off += rec_len;
+    }
+    return MULT_OK;
+}
+
+
+// Membership message of group goes to egress (queriers of the group). In
+// proxy mode it is dropped and the queriers get own report only when the
+// group got its first member port or lost the last one.
+void IgmpTable::report_upstream(__be32 group_id, bool was_active, u_int64_t *egress)
+{
+    if (!this->proxy_reporting) {
+        if (*egress) {
+            __atomic_fetch_add(&(this->reports_forwarded), 1, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+
+    bool active = group_ports(group_id) != 0;
+    if (active != was_active) {
+        send_igmp(active ? IGMPV2_HOST_MEMBERSHIP_REPORT : IGMP_HOST_LEAVE_MESSAGE, group_id, *egress);
+    }
+    __atomic_fetch_add(&(this->reports_suppressed), 1, __ATOMIC_RELAXED);
+    *egress = 0;
+}
+
+
+static u_int16_t inet_checksum(const u_int8_t *data, size_t len)
+{
+    u_int32_t sum = 0;
+    for (size_t i=0; i + 1 < len; i += 2) {
+        sum += (data[i] << 8) | data[i + 1];
+    }
+    if (len & 1) {
+        sum += data[len - 1] << 8;
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return htons(~sum);
+}
+
+
+// IGMPv2 report, leave or group specific query of the switch itself
+// (source address 0.0.0.0, router alert option) queued to ports in bitmap
+void IgmpTable::send_igmp(u_int8_t type, __be32 group_id, u_int64_t ports)
+{
+    static const u_int8_t proxy_mac[ETH_ALEN] = IGMP_PROXY_MAC;
+    u_int8_t frame[ETH_ZLEN];
+
+    if (!this->pool || !ports) {
+        return;
+    }
+
+    u_int32_t daddr = (type == IGMP_HOST_LEAVE_MESSAGE) ? IGMP_ALL_ROUTERS : group_id;
+    memset(frame, 0, sizeof(frame));
+    struct ethhdr *eth_hdr = (struct ethhdr *) frame;
+    eth_hdr->h_dest[0] = 0x01;
+    eth_hdr->h_dest[1] = 0x00;
+    eth_hdr->h_dest[2] = 0x5e;
+    eth_hdr->h_dest[3] = (daddr >> 16) & 0x7f;
+    eth_hdr->h_dest[4] = (daddr >> 8) & 0xff;
+    eth_hdr->h_dest[5] = daddr & 0xff;
+    memcpy(eth_hdr->h_source, proxy_mac, ETH_ALEN);
+    eth_hdr->h_proto = htons(ETH_P_IP);
+
+    struct iphdr *ip_hdr = (struct iphdr *) (frame + sizeof(struct ethhdr));
+    size_t ip_hdr_len = sizeof(struct iphdr) + 4;
+    ip_hdr->version = 4;
+    ip_hdr->ihl = ip_hdr_len / 4;
+    ip_hdr->tos = 0xc0;
+    ip_hdr->tot_len = htons(ip_hdr_len + sizeof(struct igmphdr));
+    ip_hdr->ttl = 1;
+    ip_hdr->protocol = IGMP_PROTOCOL;
+    ip_hdr->saddr = 0;
+    ip_hdr->daddr = htonl(daddr);
+    u_int8_t *router_alert = (u_int8_t *) ip_hdr + sizeof(struct iphdr);
+    router_alert[0] = 0x94;
+    router_alert[1] = 0x04;
+    ip_hdr->check = inet_checksum((u_int8_t *) ip_hdr, ip_hdr_len);
+
+    struct igmphdr *igmp_hdr = (struct igmphdr *) ((u_int8_t *) ip_hdr + ip_hdr_len);
+    igmp_hdr->type = type;
+    igmp_hdr->code = (type == IGMP_HOST_MEMBERSHIP_QUERY) ? IGMP_LAST_MEMBER_RESP : 0;
+    igmp_hdr->group = htonl(group_id);
+    igmp_hdr->csum = inet_checksum((u_int8_t *) igmp_hdr, sizeof(struct igmphdr));
+
+    PacketBuf *buf = this->pool->alloc(frame, sizeof(frame));
+    if (!buf) {
+        // Pool exhausted
+        return;
+    }
+    for (size_t i=0; i < this->ports.size() && i < IGMP_MAX_PORTS; i++) {
+        if (ports & (1ULL << i)) {
+            this->ports[i]->send_burst(&buf, 1);
+        }
+    }
+    packet_put(buf);
+    if (type != IGMP_HOST_MEMBERSHIP_QUERY) {
+        __atomic_fetch_add(&(this->reports_forwarded), 1, __ATOMIC_RELAXED);
+    }
+}
+
+
+// Proxy reporting - querier gets one report per group with members
+// (group specific query only the one of group_id)
+void IgmpTable::answer_query(__be32 group_id, Port *querier)
 {
+    vector<__be32> active;
+
+    lock_acquire(&(this->mutex), &(this->lock_stat));
+    if (group_id != 0) {
+        IgmpRecord *irc = find_record(group_id);
+        if (irc && irc->ports) {
+            active.push_back(group_id);
+        }
+    } else {
+        for (size_t i=0; i <= this->groups->mask; i++) {
+            GroupSlot *slot = &(this->groups->slots[i]);
+            if (slot->state == GROUP_SLOT_USED && slot->record->ports) {
+                active.push_back(slot->group_id);
+            }
+        }
+    }
+    pthread_mutex_unlock(&(this->mutex));
+
+    for (size_t i=0; i < active.size(); i++) {
+        send_igmp(IGMPV2_HOST_MEMBERSHIP_REPORT, active[i], port_bit(querier));
+    }
+}
+
+
+int IgmpTable::process_igmp_packet(Port *source_port, struct igmphdr *igmp_hdr, size_t len, u_int64_t *egress)
+{
+    __be32 group_id = ntohl(igmp_hdr->group);
+
     // Membership query
     if (igmp_hdr->type == IGMP_HOST_MEMBERSHIP_QUERY) {
         add_querier(source_port);
-        if (ntohl(igmp_hdr->group) != 0) {
+        if (this->proxy_reporting) {
+            // Members downstream still get the query, their reports are suppressed
+            answer_query(group_id, source_port);
+        }
+        if (group_id != 0) {
             // Group specific query
-            add_or_update_group(ntohl(igmp_hdr->group), source_port);
-            return send_to_group(ntohl(igmp_hdr->group), packet, size);
+            add_or_update_group(group_id, source_port);
+            *egress = group_ports(group_id);
+            return MULT_OK;
         } else {
             // General query
             return MULT_BROADCAST;
@@ -250,16 +848,26 @@ int IgmpTable::process_igmp_packet(Port *source_port, const u_char *packet, size
     }
 
     // Membership report
-    if (igmp_hdr->type == IGMPV2_HOST_MEMBERSHIP_REPORT || igmp_hdr->type == IGMPV3_HOST_MEMBERSHIP_REPORT) {
-        add_group(ntohl(igmp_hdr->group)); // Create group if doesn't exists
-        add_group_member(ntohl(igmp_hdr->group), source_port);
-        return send_to_querier(ntohl(igmp_hdr->group), packet, size);
+    if (igmp_hdr->type == IGMPV3_HOST_MEMBERSHIP_REPORT) {
+        return process_igmpv3_report(source_port, (const u_int8_t *) igmp_hdr, len, egress);
+    }
+
+    if (igmp_hdr->type == IGMPV2_HOST_MEMBERSHIP_REPORT) {
+        bool active = group_ports(group_id) != 0;
+        add_group(group_id); // Create group if doesn't exists
+        add_group_member(group_id, source_port);
+        *egress = querier_ports(group_id);
+        report_upstream(group_id, active, egress);
+        return MULT_OK;
     }
 
     // Membership leave group
     if (igmp_hdr->type == IGMP_HOST_LEAVE_MESSAGE) {
-        remove_group_member(ntohl(igmp_hdr->group), source_port);
-        return send_to_querier(ntohl(igmp_hdr->group), packet, size);
+        bool active = group_ports(group_id) != 0;
+        remove_group_member(group_id, source_port);
+        *egress = querier_ports(group_id);
+        report_upstream(group_id, active, egress);
+        return MULT_OK;
     }
     
 //    printf("Neznamy typ (0x%02x) IGMP packetu\n", igmp_hdr->type);
@@ -269,8 +877,10 @@ int IgmpTable::process_igmp_packet(Port *source_port, const u_char *packet, size
 
 
 
-int IgmpTable::process_multicast_packet(Port *source_port, const u_char *packet, size_t size)
+int IgmpTable::process_multicast_packet(Port *source_port, PacketBuf *buf, u_int64_t *egress)
 {
+    const u_char *packet = buf->data;
+    size_t size = buf->len;
     struct ethhdr  *eth_hdr;
     struct iphdr   *ip_hdr;
     struct igmphdr *igmp_hdr;
@@ -279,9 +889,31 @@ int IgmpTable::process_multicast_packet(Port *source_port, const u_char *packet,
     size_t ip_hdr_len;
     size_t igmp_hdr_len;
 
+    *egress = 0;
     eth_hdr = (struct ethhdr *) packet;
     eth_hdr_len = sizeof(struct ethhdr);
 
+    // Fast path - IPv4 data frame, destination MAC decides if the frame goes
+    // to the only known group of the MAC (unknown groups have no members)
+    ip_hdr = (struct iphdr *) (packet + sizeof(struct ethhdr));
+    if (this->mac_fast_path && size >= eth_hdr_len + sizeof(struct iphdr)
+        && eth_hdr->h_proto == htons(ETH_P_IP) && ip_hdr->protocol != IGMP_PROTOCOL) {
+        u_int32_t mac = (eth_hdr->h_dest[3] << 16) | (eth_hdr->h_dest[4] << 8) | eth_hdr->h_dest[5];
+        if (mac != 0 && mac <= MCAST_MAC_MASK) {
+            McastMacTable *table = __atomic_load_n(&(this->macs), __ATOMIC_ACQUIRE);
+            McastMacEntry *entry = mcast_mac_find(table, mac);
+            u_int32_t state = entry ? __atomic_load_n(&(entry->state), __ATOMIC_ACQUIRE) : MAC_ENTRY_NONE;
+            if (state == MAC_ENTRY_NONE) {
+                // No group with members
+                return MULT_OK;
+            }
+            if (state == MAC_ENTRY_PORTS && ip_hdr->daddr == __atomic_load_n(&(entry->group), __ATOMIC_RELAXED)) {
+                *egress = __atomic_load_n(&(entry->ports), __ATOMIC_RELAXED);
+                return MULT_OK;
+            }
+        }
+    }
+
     if (eth_hdr_len > size) {
         // Bad packet
         return MULT_ERR;
@@ -317,7 +949,7 @@ int IgmpTable::process_multicast_packet(Port *source_port, const u_char *packet,
             return MULT_ERR;
         }
         
-        return this->process_igmp_packet(source_port, packet, size, igmp_hdr);
+        return this->process_igmp_packet(source_port, igmp_hdr, size - eth_hdr_len - ip_hdr_len, egress);
     }
     
     
@@ -328,61 +960,113 @@ int IgmpTable::process_multicast_packet(Port *source_port, const u_char *packet,
         return MULT_BROADCAST;
     }
     
-    return send_to_group(ntohl(ip_hdr->daddr), packet, size);
+    *egress = group_ports(ntohl(ip_hdr->daddr), ntohl(ip_hdr->saddr));
+    return MULT_OK;
 }
 
 
 void IgmpTable::print_table()
 {
-    IgmpRecordTable::iterator it;
     printf("GroupAddr\tIfaces\n");
 
-    pthread_mutex_lock(&(this->mutex));
+    lock_acquire(&(this->mutex), &(this->lock_stat));
 
-    for (it=this->records.begin(); it != this->records.end(); it++) {
-        IgmpRecord *irc = (IgmpRecord *) it->second;
+    for (size_t i=0; i <= this->groups->mask; i++) {
+        if (this->groups->slots[i].state != GROUP_SLOT_USED) {
+            continue;
+        }
+        IgmpRecord *irc = this->groups->slots[i].record;
         printf("%s\t", print_ip(irc->group_id).c_str());
         if (irc->igmp_querier) {
             printf("*%s, ", irc->igmp_querier->name.c_str());
         }
-        for (size_t i=0; i < irc->ports.size();) {
-            printf("%s", irc->ports[i]->name.c_str());
-            i++;
-            if (i < irc->ports.size()) {
-                printf(", ");
+        bool first = true;
+        for (size_t j=0; j < this->ports.size() && j < IGMP_MAX_PORTS; j++) {
+            if (irc->ports & (1ULL << j)) {
+                printf("%s%s", first ? "" : ", ", this->ports[j]->name.c_str());
+                first = false;
+                if (irc->filters.count(j)) {
+                    // Source filter of the member
+                    IgmpFilter &filter = irc->filters[j];
+                    printf(" (%s", filter.exclude ? "EX" : "IN");
+                    for (set<__be32>::iterator src = filter.sources.begin(); src != filter.sources.end(); src++) {
+                        printf(" %s", print_ip(*src).c_str());
+                    }
+                    printf(")");
+                }
             }
         }
         printf("\n");
     }
 
     pthread_mutex_unlock(&(this->mutex));
+
+    printf("Reports: %zu forwarded, %zu suppressed%s\n",
+           __atomic_load_n(&(this->reports_forwarded), __ATOMIC_RELAXED),
+           __atomic_load_n(&(this->reports_suppressed), __ATOMIC_RELAXED),
+           this->proxy_reporting ? " (proxy reporting)" : "");
 }
 
 
-void IgmpTable::purge()
+void IgmpTable::arm_group_timer(IgmpRecord *irc, u_int32_t now)
 {
-    IgmpRecordTable::iterator it;
-    pthread_mutex_lock(&(this->mutex));
-    for (it=this->records.begin(); it != this->records.end(); it++) {
-        IgmpRecord *irc = (IgmpRecord *) it->second;
-        vector<Port*>::iterator it_p;
-        vector<time_t>::iterator it_t;
-        
-        time_t cur_time = time(NULL);   
-        it_p = irc->ports.begin();
-        it_t = irc->last_used_vector.begin();
-
-        while (it_t != irc->last_used_vector.end()) {
-            time_t port_time = cur_time - (*it_t);
-            if (port_time > IGMP_PORT_TIMEOUT) {
-                it_p = irc->ports.erase(it_p);
-                it_t = irc->last_used_vector.erase(it_t);
-            } else {
-                ++it_p;
-                ++it_t;
+    irc->group_timer = now + IGMP_PORT_TIMEOUT + 1;
+    this->wheel.add(IGMP_TIMER_ID(irc->group_id, (Port *) NULL), irc->group_timer);
+}
+
+
+// Handle one expired timer, caller holds the mutex. Timers whose member
+// (or group) is gone or was re-armed meanwhile are stale and ignored.
+void IgmpTable::expire_timer(WheelTimer &timer, u_int32_t now)
+{
+    unsigned int port_id = timer.id & 0xffff;
+
+    IgmpRecord *irc = find_record(timer.id >> 16);
+    if (irc == NULL) {
+        return;
+    }
+
+    if (port_id == 0) {
+        // Group timer - remove group if nobody joined it meanwhile
+        if (irc->group_timer == timer.expires && !irc->ports) {
+            remove_record(irc);
+        }
+        return;
+    }
+
+    unsigned int index = port_id - 1;
+    if (index >= IGMP_MAX_PORTS || !(irc->ports & (1ULL << index)) || irc->timer[index] != timer.expires) {
+        return;
+    }
+
+    if ((int32_t) (now - irc->last_used[index]) > IGMP_PORT_TIMEOUT) {
+        remove_member(irc, index);
+        if (!irc->ports) {
+            // Last member expired -> remove empty group
+            if (this->proxy_reporting) {
+                u_int64_t queriers = irc->igmp_querier ? port_bit(irc->igmp_querier)
+                                     : __atomic_load_n(&(this->queriers), __ATOMIC_RELAXED);
+                send_igmp(IGMP_HOST_LEAVE_MESSAGE, irc->group_id, queriers);
             }
+            remove_record(irc);
         }
+    } else {
+        // Member was refreshed - wait for the rest of its timeout
+        irc->timer[index] = irc->last_used[index] + IGMP_PORT_TIMEOUT + 1;
+        this->wheel.add(timer.id, irc->timer[index]);
     }
+}
+
 
+void IgmpTable::purge()
+{
+    vector<WheelTimer> expired;
+    u_int32_t now = coarse_time();
+
+    lock_acquire(&(this->mutex), &(this->lock_stat));
+    this->wheel.advance(now, expired);
+    for (size_t i=0; i < expired.size(); i++) {
+        expire_timer(expired[i], now);
+    }
     pthread_mutex_unlock(&(this->mutex));   
 }
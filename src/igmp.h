@@ -2,41 +2,176 @@
 #define __SWITCH_IGMP_H__
 
 #include <ctime>
-#include <map>
 #include <vector>
+#include <map>
+#include <set>
 #include <linux/ip.h>
 #include "port.h"
+#include "aging.h"
+#include "lockstat.h"
 
 using namespace std;
 
 #define IGMP_PORT_TIMEOUT 30
+#define IGMP_LAST_MEMBER_TIME   2   // s, member which sent leave is kept for a group specific query response
+
+#define IGMP_MAX_PORTS      64      // membership is kept as 64 bit port bitmap
+#define IGMP_GROUP_SLOTS    1024    // initial size of the group hash (power of two)
 
 #define MULT_OK         0
 #define MULT_BROADCAST  1
 #define MULT_ERR        2
 
+#define IGMP_ALL_ROUTERS    0xe0000002  // 224.0.0.2, destination of leave messages
+#define IGMP_PROXY_MAC      {0x02, 0x00, 0x00, 0x00, 0x00, 0x01}    // source of proxy reports
+
+#define MCAST_MAC_SLOTS     1024    // initial size of the multicast MAC hash (power of two)
+#define MCAST_MAC_MASK      0x7fffff    // IPv4 group maps to MAC by its low 23 bits
+
+#define GROUP_SLOT_EMPTY    0
+#define GROUP_SLOT_USED     1
+#define GROUP_SLOT_DELETED  2       // keeps its group address until the table is rebuilt
+
+
+// Ports that listed the source in their IGMPv3 filter
+class SourceMask {
+    public:
+        __be32 source;
+        u_int64_t include;  // INCLUDE mode ports that want the source
+        u_int64_t exclude;  // EXCLUDE mode ports that block the source
+};
+
+
+// Forwarding state of a group as seen by the data plane. Never modified
+// after it was published, membership change publishes a new snapshot.
+// Traffic from source S goes to (exclude & ~S.exclude) | S.include.
+class GroupSnapshot {
+    public:
+        __be32 group_id;
+        u_int64_t ports;        // bitmap of member port indexes
+        u_int64_t exclude;      // members in EXCLUDE mode (any source unless blocked)
+        u_int32_t nsources;
+        SourceMask sources[];   // sorted by source address
+};
+
+
+// IGMPv3 source filter of member port. Members without a filter are
+// in EXCLUDE mode with no sources (IGMPv2 behaviour).
+class IgmpFilter {
+    public:
+        bool exclude;
+        set<__be32> sources;
+};
+
+
+// Control plane state of a group, protected by IgmpTable mutex
 class IgmpRecord {
     public:
         __be32 group_id;
         Port *igmp_querier;
-        vector<Port*> ports;
-        vector<time_t> last_used_vector; // time of last membership query for port on same index in ports
+        u_int64_t ports;                        // bitmap of member port indexes
+        u_int32_t last_used[IGMP_MAX_PORTS];    // time of last membership report of member port
+        u_int32_t timer[IGMP_MAX_PORTS];        // expiry of the armed aging timer of member port
+        u_int32_t group_timer;                  // expiry of the armed timer of group without members
+        map<unsigned int, IgmpFilter> filters;  // port index -> source filter, only source specific members
 };
 
 
-typedef map<__be32, IgmpRecord*> IgmpRecordTable;
+class GroupSlot {
+    public:
+        __be32 group_id;
+        int state;              // GROUP_SLOT_*
+        IgmpRecord *record;     // control plane only
+        GroupSnapshot *snap;    // NULL if the group has no members
+};
+
+
+// Open addressing hash of groups. Slots are never reused for another group,
+// when the table fills up with deleted slots a new one is built and the
+// old one is freed through RCU.
+class GroupTable {
+    public:
+        size_t mask;
+        size_t used;
+        size_t deleted;
+        GroupSlot slots[];
+};
+
+
+#define MAC_ENTRY_EMPTY     0       // free slot
+#define MAC_ENTRY_NONE      1       // no group with members maps to the MAC
+#define MAC_ENTRY_PORTS     2       // egress ports of the MAC are known
+#define MAC_ENTRY_AMBIGUOUS 3       // more groups share the MAC, IP address decides
+
+class McastMacEntry {
+    public:
+        u_int32_t mac;      // low 23 bits of multicast MAC
+        u_int32_t state;    // MAC_ENTRY_*
+        u_int64_t ports;    // valid in MAC_ENTRY_PORTS state
+        __be32 group;       // the only IPv4 group of the MAC (network order), valid with ports
+};
+
+
+// Multicast MAC -> egress ports for data frames, so most frames are
+// forwarded without a group lookup. Up to 32 IPv4 groups share one MAC,
+// such MAC is usable only when a single known group maps to it and the
+// frame is sent to that group (checked against the IP destination).
+// Written under IgmpTable mutex, read lock free. Slot keeps its MAC until
+// the table is rebuilt (old one is freed through RCU).
+class McastMacTable {
+    public:
+        size_t mask;
+        size_t used;
+        McastMacEntry entries[];
+};
+
+McastMacTable *mcast_mac_alloc(size_t slots);
+McastMacEntry *mcast_mac_find(McastMacTable *table, u_int32_t mac); // lock free, NULL if the MAC has no slot
+// Writer side (serialized by the owner), new entry is in MAC_ENTRY_NONE state.
+// Full table is rebuilt and the old one retired through RCU.
+McastMacEntry *mcast_mac_insert(McastMacTable **table, u_int32_t mac);
 
 
+// Membership changes (IGMP messages, aging) are serialized by the mutex,
+// forwarding of multicast data reads published snapshots without locking.
+// Data plane threads have to be registered RCU readers.
 class IgmpTable {
     private:
         pthread_mutex_t mutex;
-        IgmpRecordTable records;
-        vector<Port*> queriers;
+        GroupTable *groups;
+        McastMacTable *macs;
+        u_int64_t queriers;     // bitmap of ports with multicast router
         vector<Port*> ports;
-        int process_igmp_packet(Port *source_port, const u_char *packet, 
-                           size_t size, struct igmphdr *igmp_hdr);
+        TimingWheel wheel; // aging timers of group members and empty groups, protected by mutex
+        PacketPool *pool;   // own IGMP messages, none are sent when NULL
+
+        GroupTable *alloc_groups(size_t slots);
+        GroupSlot *find_slot(GroupTable *table, __be32 group_id);
+        IgmpRecord *find_record(__be32 group_id);
+        IgmpRecord *create_record(__be32 group_id);
+        void remove_record(IgmpRecord *irc);
+        void rebuild_groups(size_t slots);
+        void publish(IgmpRecord *irc);
+        void update_mac(__be32 group_id);
+        void remove_member(IgmpRecord *irc, unsigned int index);
+        void arm_group_timer(IgmpRecord *irc, u_int32_t now);
+        void expire_timer(WheelTimer &timer, u_int32_t now);
+        int process_igmp_packet(Port *source_port, struct igmphdr *igmp_hdr, size_t len, u_int64_t *egress);
+        int process_igmpv3_report(Port *source_port, const u_int8_t *report, size_t len, u_int64_t *egress);
+        void report_upstream(__be32 group_id, bool was_active, u_int64_t *egress);
+        void send_igmp(u_int8_t type, __be32 group_id, u_int64_t ports);
+        void leave_member(IgmpRecord *irc, Port *port);
+        void answer_query(__be32 group_id, Port *querier);
 
     public:
+        LockStat lock_stat; // contention of mutex
+        bool mac_fast_path; // forward data frames by destination MAC when possible (default on)
+        // Answer queries on behalf of members and report only changes of
+        // group state upstream (needs pool)
+        bool proxy_reporting;
+        size_t reports_forwarded;   // membership messages sent to queriers (own reports in proxy mode)
+        size_t reports_suppressed;  // membership messages absorbed by proxy reporting
+
         IgmpTable();
         ~IgmpTable();
         void add_group(__be32 group_id); // Add group if doesn't exists
@@ -44,17 +179,19 @@ class IgmpTable {
         void add_group_member(__be32 group_id, Port *port);
         void add_querier(Port *port);
         void remove_group_member(__be32 group_id, Port *port);
-        int send_to_group(__be32 group_id,  const u_char *packet, size_t size);
-        void send_to_all_queriers(const u_char *packet, size_t size);
-        int send_to_querier(__be32 group_id,  const u_char *packet, size_t size);
+        // IGMPv3 group record of port (IGMPV3_* record type)
+        void apply_group_record(__be32 group_id, Port *port, int type, const __be32 *sources, unsigned int count);
+        u_int64_t group_ports(__be32 group_id);     // lock free, bitmap of member ports
+        u_int64_t group_ports(__be32 group_id, __be32 source); // lock free, member ports that accept the source
+        u_int64_t querier_ports(__be32 group_id);   // bitmap of ports reports for the group go to
 
         void set_ports(vector<Port*> ports);
+        void set_pool(PacketPool *pool); // enables own messages (queries, proxy reports)
         string print_ip(int ip);
-        int process_multicast_packet(Port *source_port, const u_char *packet, size_t size);
-        void multicast(Port *source_port, const u_char *packet, size_t size);  // Send multicast
+        // Bitmap of ports the frame goes to is stored to egress (MULT_OK only)
+        int process_multicast_packet(Port *source_port, PacketBuf *buf, u_int64_t *egress);
         void print_table();
-        void purge();
+        void purge(); // remove expired group members and empty groups
 };
 
 #endif /* __SWITCH_IGMP_H__ */
-
@@ -0,0 +1,100 @@
+#include <cstdio>
+#include <time.h>
+#include "learner.h"
+#include "aging.h"
+
+
+Learner::Learner(CamTable *camtable, unsigned int len) : queue(len)
+{
+    this->camtable = camtable;
+    this->stopped = 0;
+    this->events = 0;
+    this->dropped = 0;
+    this->max_depth = 0;
+}
+
+
+void Learner::set_ports(std::vector<Port*> ports)
+{
+    this->ports = ports;
+}
+
+
+void Learner::post(u_int64_t key, Port *port)
+{
+    // Record word is never zero, port index + 1 is in the high bits
+    u_int64_t entry = key | ((u_int64_t) (port->index + 1) << CAM_PORT_SHIFT);
+    if (this->queue.enqueue((void *) entry) < 0) {
+        // Full - the next frame from the source tries again
+        __atomic_fetch_add(&(this->dropped), 1, __ATOMIC_RELAXED);
+        return;
+    }
+    __atomic_fetch_add(&(this->events), 1, __ATOMIC_RELAXED);
+}
+
+
+void Learner::run()
+{
+    u_int32_t purged = coarse_time();
+
+    while (!this->stopped) {
+        size_t cur_depth = this->queue.depth();
+        if (cur_depth > this->max_depth) {
+            this->max_depth = cur_depth;
+        }
+
+        void *event;
+        unsigned int n = 0;
+        while ((event = this->queue.dequeue()) != NULL) {
+            u_int64_t entry = (u_int64_t) event;
+            unsigned int index = (entry >> CAM_PORT_SHIFT) - 1;
+            if (index < this->ports.size()) {
+                this->camtable->update(entry & CAM_KEY_MASK, this->ports[index]);
+            }
+            n++;
+        }
+
+        // Aging once per tick of the coarse clock
+        u_int32_t now = coarse_time();
+        if (now != purged) {
+            this->camtable->purge();
+            purged = now;
+        }
+
+        if (n == 0) {
+            struct timespec delay;
+            delay.tv_sec = 0;
+            delay.tv_nsec = LEARN_POLL_US * 1000;
+            nanosleep(&delay, NULL);
+        }
+    }
+}
+
+
+void Learner::stop()
+{
+    this->stopped = 1;
+}
+
+
+size_t Learner::depth()
+{
+    return this->queue.depth();
+}
+
+
+void Learner::print_stat()
+{
+    printf("Learn queue: %zu/%zu (max %zu), %zu events, %zu dropped\n",
+           depth(), (size_t) LEARN_QUEUE_LEN, this->max_depth,
+           __atomic_load_n(&(this->events), __ATOMIC_RELAXED),
+           __atomic_load_n(&(this->dropped), __ATOMIC_RELAXED));
+}
+
+
+void *learner_thread(void *arg)
+{
+    Learner *learner = (Learner *) arg;
+    learner->run();
+    return NULL;
+}
@@ -0,0 +1,44 @@
+#ifndef __SWITCH_LEARNER_H__
+#define __SWITCH_LEARNER_H__
+
+#include <vector>
+#include <sys/types.h>
+#include "port.h"
+#include "camtable.h"
+#include "queue.h"
+
+#define LEARN_QUEUE_LEN     4096    // learn events, must be power of two
+#define LEARN_POLL_US       100     // sleep of idle learner
+
+
+// Owner of all CAM table mutations. Port threads only look the source
+// address up (read only, see FwdCache) and post a learn event when the
+// address is new, moved or its record is due for refresh. Event is the CAM record word
+// (MAC key + port index) carried in a lock free MPSC queue, it is applied
+// with the coarse time at which the learner takes it out.
+// The learner also runs CAM aging.
+class Learner {
+    private:
+        CamTable *camtable;
+        std::vector<Port*> ports;
+        PtrQueue queue;
+
+    public:
+        volatile int stopped;
+        size_t events;      // posted learn events
+        size_t dropped;     // events lost because the queue was full
+        size_t max_depth;   // highest occupancy seen by the learner
+
+        Learner(CamTable *camtable, unsigned int len);
+        void set_ports(std::vector<Port*> ports);
+        void post(u_int64_t key, Port *port);   // data plane, learn source address on port
+        void run();                 // learner thread, returns after stop()
+        void stop();
+        size_t depth();
+        void print_stat();
+};
+
+
+void *learner_thread(void *arg);    // arg is Learner*
+
+#endif /* __SWITCH_LEARNER_H__ */
@@ -0,0 +1,40 @@
+#ifndef __SWITCH_LOCKSTAT_H__
+#define __SWITCH_LOCKSTAT_H__
+
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "aging.h"
+
+
+// Contention statistics of one mutex. Counters are updated only while
+// the mutex is held, readers may see slightly stale values.
+class LockStat {
+    public:
+        size_t acquired;
+        size_t contended;   // acquisitions that had to wait
+        u_int64_t wait_ns;  // total time spent waiting
+
+        LockStat() : acquired(0), contended(0), wait_ns(0) {}
+        void print(const char *name)
+        {
+            printf("%s lock: %zu acquired, %zu contended, wait %.1f us\n", name,
+                   this->acquired, this->contended, this->wait_ns / 1000.0);
+        }
+};
+
+
+// Lock mutex and account the time spent waiting for it. Uncontended case
+// costs the same as pthread_mutex_lock().
+static inline void lock_acquire(pthread_mutex_t *mutex, LockStat *stat)
+{
+    if (pthread_mutex_trylock(mutex) != 0) {
+        u_int64_t start = mono_ns();
+        pthread_mutex_lock(mutex);
+        stat->contended++;
+        stat->wait_ns += mono_ns() - start;
+    }
+    stat->acquired++;
+}
+
+#endif /* __SWITCH_LOCKSTAT_H__ */
@@ -3,20 +3,37 @@
 #include <pthread.h>
 #include <pcap.h>
 #include <string.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include "port.h"
 #include "port_thread.h"
 #include "camtable.h"
 #include "igmp.h"
+#include "mld.h"
+#include "learner.h"
+#include "aging.h"
+#include "classify.h"
+#include "rcu.h"
+#include "placement.h"
+#include "engine.h"
+#include "histogram.h"
 
 using namespace std;
 
-#define PURGE_INTERVAL     1   // In seconds
+#define PURGE_INTERVAL     1   // In seconds (resolution of the coarse clock and aging timers)
+
+#define LAT_FORWARD        0   // kernel receive to transmit done
+#define LAT_CAM            1   // single CAM (forwarding cache) lookups
+#define LAT_TX_CALL        2   // transmit syscalls
+#define LAT_HISTS          3
 
 volatile int should_end = 0;
 
-CamTable *g_camtable = NULL;
 IgmpTable *g_igmptable = NULL;
+MldTable *g_mldtable = NULL;
+vector<Port*> *g_ports = NULL;
+PacketPool *g_pool = NULL;
+EventEngine *g_engine = NULL;
 
 void *cam_cleaner_thread(void *arg)
 {
@@ -25,12 +42,25 @@ void *cam_cleaner_thread(void *arg)
             return NULL;
         }
         sleep(PURGE_INTERVAL);
-        if (g_camtable) {
-            g_camtable->purge();
+        coarse_clock_update();
+        if (g_ports) {
+            for (size_t i=0; i < g_ports->size(); i++) {
+                (*g_ports)[i]->sample_rate();
+            }
+        }
+        if (g_pool) {
+            g_pool->check_oversize(coarse_time());
         }
         if (g_igmptable) {
             g_igmptable->purge();
         }
+        if (g_mldtable) {
+            g_mldtable->purge();
+        }
+        if (g_engine) {
+            g_engine->rebalance();
+        }
+        rcu_reclaim();
     }
     
     return NULL;
@@ -38,14 +68,296 @@ void *cam_cleaner_thread(void *arg)
 
 
 
-int main() {
+void usage(const char *prog)
+{
+    printf("Usage: %s [options]\n", prog);
+    printf(" -b BACKEND   receive backend: ring (AF_PACKET TPACKET_V3, default) or pcap\n");
+    printf(" -s BYTES     ring block size (default %d)\n", RING_DEF_BLOCK_SIZE);
+    printf(" -n COUNT     number of ring blocks (default %d)\n", RING_DEF_BLOCK_NR);
+    printf(" -f BYTES     ring frame size, also the largest forwarded frame - bigger ones (jumbo,\n"
+           "              GRO) are dropped and counted as oversize, turn GRO/LRO off with\n"
+           "              ethtool -K IFACE gro off lro off (default %d)\n", RING_DEF_FRAME_SIZE);
+    printf(" -t MS        ring block retire timeout (default %d)\n", RING_DEF_TIMEOUT);
+    printf(" -x FRAMES    transmit batch size (default %d)\n", TX_DEF_BATCH);
+    printf(" -w US        max time a frame waits in transmit ring (default %d = flush when egress queue is drained)\n", TX_DEF_FLUSH_US);
+    printf(" -q FRAMES    egress queue length, power of two (default %d)\n", QUEUE_DEF_LEN);
+    printf(" -L US        low latency mode - frames are received one by one (TPACKET_V2 ring or pcap\n"
+           "              immediate mode) by busy polling loop, US is SO_BUSY_POLL time of the socket\n");
+    printf(" -W COUNT     receive threads per port sharing the interface by flow hash (ring backend,\n"
+           "              default %d, max %d)\n", PORT_DEF_RX_WORKERS, PORT_RX_COUNTERS);
+    printf(" -E WORKERS   event loop mode - WORKERS threads serve receive rings and egress queues\n"
+           "              of all ports by epoll (default 0 = receive and transmit threads per port)\n");
+    printf(" -c CPUS      data CPUs (e.g. 0-3,6), every receive thread is bound to one of them,\n"
+           "              preferably on NUMA node of its interface\n");
+    printf(" -k CPUS      housekeeping CPUs for cleaner, learner and command line (default CPUs\n"
+           "              not given by -c, with -k only the data CPUs are the rest)\n");
+    printf(" -H           latency histograms on from start (command lat on/off)\n");
+    printf(" -p BUFFERS   number of packet buffers shared by all ports (default %d)\n", POOL_DEF_BUFFERS);
+    printf(" -r IN:OUT    replay mode - add port reading frames from pcap file IN and writing\n"
+           "              sent frames to pcap file OUT (repeat for more ports), no interfaces are used\n");
+    printf(" -P           replay with original timing of the trace (default as fast as possible)\n");
+    printf(" -R           IGMP proxy reporting (queries are answered by the switch, only first\n");
+    printf("              join and last leave of a group are reported to queriers)\n");
+    printf(" -l PORT      IGMP/MLD fast leave on port (single host, pruned without group specific\n");
+    printf("              query), repeat for more ports or use \"all\"\n");
+    printf(" -h           show this help\n");
+}
+
+
+void print_stat(vector<Port*> &ports, PacketPool &pool)
+{
+    printf("Iface\tSent-B\tSent-frm\tRecv-B\tRecv-frm\tQueue/Max\tDrops\tTx-drops\tSent-pps/bps\tRecv-pps/bps\n");
+    for (size_t i=0; i < ports.size(); i++) {
+        ports[i]->print_stat();
+    }
+    pool.print_stat();
+}
+
+
+void print_cache_stat(vector<PortThreadData*> &thread_data_table)
+{
+    size_t hits = 0, misses = 0;
+    for (size_t i=0; i < thread_data_table.size(); i++) {
+        hits += __atomic_load_n(&(thread_data_table[i]->fwd_cache.hits), __ATOMIC_RELAXED);
+        misses += __atomic_load_n(&(thread_data_table[i]->fwd_cache.misses), __ATOMIC_RELAXED);
+    }
+    printf("Forwarding cache: %zu hits, %zu misses (%.1f%% hit rate)\n",
+           hits, misses, hits + misses ? 100.0 * hits / (hits + misses) : 0.0);
+}
+
+
+// Receive threads of all ports, kernel drops are counted per ring
+void print_worker_stat(vector<PortThreadData*> &thread_data_table)
+{
+    printf("Worker\tCPU\tRecv-B\tRecv-frm\tRing-drops\tCache-hits\n");
+    for (size_t i=0; i < thread_data_table.size(); i++) {
+        PortThreadData *tdata = thread_data_table[i];
+        size_t hits = __atomic_load_n(&(tdata->fwd_cache.hits), __ATOMIC_RELAXED);
+        size_t misses = __atomic_load_n(&(tdata->fwd_cache.misses), __ATOMIC_RELAXED);
+        unsigned long long drops = 0;
+        if (tdata->port->backend == PORT_BACKEND_RING) {
+            drops = tdata->port->rx_ring[tdata->worker].get_drops();
+        }
+        char cpu[16] = "-";
+        if (tdata->cpu >= 0) {
+            snprintf(cpu, sizeof(cpu), "%d", tdata->cpu);
+        }
+        printf("%s/%u\t%s\t%llu\t%llu\t%llu\t%.1f%%\n", tdata->port->name.c_str(), tdata->worker, cpu,
+               (unsigned long long) tdata->rx_counter->get_bytes(), (unsigned long long) tdata->rx_counter->get_frames(),
+               drops, hits + misses ? 100.0 * hits / (hits + misses) : 0.0);
+    }
+}
+
+
+// Histograms of all threads merged
+void collect_latency(vector<PortThreadData*> &thread_data_table, vector<Port*> &ports, LatencyHistogram *hists)
+{
+    for (int i=0; i < LAT_HISTS; i++) {
+        hists[i].clear();
+    }
+    for (size_t i=0; i < thread_data_table.size(); i++) {
+        hists[LAT_CAM].add(thread_data_table[i]->cam_hist);
+    }
+    for (size_t i=0; i < ports.size(); i++) {
+        hists[LAT_FORWARD].add(ports[i]->forward_hist);
+        hists[LAT_TX_CALL].add(ports[i]->tx_call_hist);
+    }
+}
+
+
+// Values recorded since the last reset (base holds the sums taken then)
+void print_latency(vector<PortThreadData*> &thread_data_table, vector<Port*> &ports, LatencyHistogram *base)
+{
+    if (!LATENCY_HIST) {
+        printf("Latency histograms are compiled out (build with HIST=1)\n");
+        return;
+    }
+
+    LatencyHistogram hists[LAT_HISTS];
+    collect_latency(thread_data_table, ports, hists);
+    for (int i=0; i < LAT_HISTS; i++) {
+        hists[i].subtract(base[i]);
+    }
+    printf("Latency histograms are %s\n", hist_on() ? "on" : "off");
+    printf("%-20s %12s %10s %10s %10s %10s\n", "Latency [us]", "Count", "p50", "p99", "p99.9", "max");
+    print_histogram("Receive to sent", hists[LAT_FORWARD]);
+    print_histogram("CAM lookup", hists[LAT_CAM]);
+    print_histogram("Send syscall", hists[LAT_TX_CALL]);
+}
+
+
+// Summary of replay mode, rates are computed from received traffic
+void replay_report(vector<Port*> &ports, PacketPool &pool, double elapsed)
+{
+    unsigned long long recv_f = 0, recv_b = 0, send_f = 0, send_b = 0;
+    for (size_t i=0; i < ports.size(); i++) {
+        recv_f += ports[i]->recv_frames();
+        recv_b += ports[i]->recv_bytes();
+        send_f += ports[i]->sent_frames();
+        send_b += ports[i]->sent_bytes();
+    }
+    printf("Replayed %llu frames (%llu B) in %.3f s: %.3f Mpps, %.3f Gbps\n", recv_f, recv_b, elapsed,
+           elapsed > 0 ? recv_f / elapsed / 1e6 : 0.0, elapsed > 0 ? recv_b * 8 / elapsed / 1e9 : 0.0);
+    printf("Sent %llu frames (%llu B)\n", send_f, send_b);
+    print_stat(ports, pool);
+}
+
+
+// Parse positive number option, returns 0 on error
+unsigned int parse_uint(const char *str)
+{
+    char *end;
+    unsigned long val = strtoul(str, &end, 0);
+    if (*str == '\0' || *end != '\0') {
+        return 0;
+    }
+    return (unsigned int) val;
+}
+
+
+
+int main(int argc, char **argv) {
     int ret;
+    int opt;
     char errbuf[PCAP_ERRBUF_SIZE];	/* Error string */
+    PortConfig port_config;
+    unsigned int pool_buffers = POOL_DEF_BUFFERS;
+    vector<string> replay_files;    // IN:OUT pairs
+    bool proxy_reporting = false;
+    vector<string> fast_leave;      // names of fast leave ports
+    vector<int> data_cpus;          // CPUs for receive and TX threads
+    vector<int> housekeeping_cpus;
+    Placement placement;
+    unsigned int engine_workers = 0;    // 0 = threads per port
+
+    while ((opt = getopt(argc, argv, "b:s:n:f:t:x:w:q:L:W:E:c:k:Hp:r:PRl:h")) != -1) {
+        switch (opt) {
+            case 'b':
+                if (!strcmp(optarg, "ring")) {
+                    port_config.backend = PORT_BACKEND_RING;
+                } else if (!strcmp(optarg, "pcap")) {
+                    port_config.backend = PORT_BACKEND_PCAP;
+                } else {
+                    fprintf(stderr, "Unknown backend \"%s\"\n", optarg);
+                    return 1;
+                }
+                break;
+            case 's':
+                port_config.ring_block_size = parse_uint(optarg);
+                break;
+            case 'n':
+                port_config.ring_block_nr = parse_uint(optarg);
+                break;
+            case 'f':
+                port_config.ring_frame_size = parse_uint(optarg);
+                break;
+            case 't':
+                port_config.ring_timeout = parse_uint(optarg);
+                break;
+            case 'x':
+                port_config.tx_batch = parse_uint(optarg);
+                break;
+            case 'w':
+                port_config.tx_flush_us = parse_uint(optarg);
+                break;
+            case 'q':
+                port_config.queue_len = parse_uint(optarg);
+                break;
+            case 'L':
+                port_config.busy_poll_us = parse_uint(optarg);
+                if (!port_config.busy_poll_us) {
+                    fprintf(stderr, "Busy poll time has to be positive number of us\n");
+                    return 1;
+                }
+                break;
+            case 'W':
+                port_config.rx_workers = parse_uint(optarg);
+                break;
+            case 'E':
+                engine_workers = parse_uint(optarg);
+                break;
+            case 'c':
+            case 'k':
+                if (parse_cpu_list(optarg, opt == 'c' ? data_cpus : housekeeping_cpus) < 0) {
+                    fprintf(stderr, "Invalid CPU list \"%s\"\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'H':
+                hist_enabled = 1;
+                break;
+            case 'p':
+                pool_buffers = parse_uint(optarg);
+                break;
+            case 'r':
+                if (!strchr(optarg, ':')) {
+                    fprintf(stderr, "Replay port has to be given as IN:OUT\n");
+                    return 1;
+                }
+                replay_files.push_back(optarg);
+                break;
+            case 'P':
+                port_config.replay_paced = 1;
+                break;
+            case 'R':
+                proxy_reporting = true;
+                break;
+            case 'l':
+                fast_leave.push_back(optarg);
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (!port_config.ring_block_size || !port_config.ring_block_nr || !port_config.ring_frame_size
+        || port_config.ring_block_size % getpagesize() || port_config.ring_frame_size % TPACKET_ALIGNMENT) {
+        fprintf(stderr, "Invalid ring size (block size must be multiple of page size, "
+                        "frame size multiple of %d)\n", TPACKET_ALIGNMENT);
+        return 1;
+    }
+    if (port_config.tx_batch == 0 || port_config.tx_batch > TX_RING_FRAMES) {
+        fprintf(stderr, "Transmit batch has to be 1 - %d frames\n", TX_RING_FRAMES);
+        return 1;
+    }
+    if (port_config.queue_len == 0 || (port_config.queue_len & (port_config.queue_len - 1))) {
+        fprintf(stderr, "Egress queue length has to be power of two\n");
+        return 1;
+    }
+    if (port_config.rx_workers == 0 || port_config.rx_workers > PORT_RX_COUNTERS) {
+        fprintf(stderr, "Receive threads per port have to be 1 - %d\n", PORT_RX_COUNTERS);
+        return 1;
+    }
+    if (engine_workers && port_config.replay_paced) {
+        fprintf(stderr, "Paced replay is not supported in event loop mode\n");
+        return 1;
+    }
+    if (pool_buffers == 0) {
+        fprintf(stderr, "Invalid number of packet buffers\n");
+        return 1;
+    }
+
+    if ((!data_cpus.empty() || !housekeeping_cpus.empty())
+        && placement.setup(data_cpus, housekeeping_cpus) < 0) {
+        return 1;
+    }
+    // Command line and everything main() allocates for shared use runs on housekeeping CPUs
+    if ((ret = placement.bind_self(placement.housekeeping_cpus)) != 0) {
+        fprintf(stderr, "pthread_setaffinity_np() error: %d\n", ret);
+        return 1;
+    }
+
+    coarse_clock_update();
+    classify_impl();  // select classifier before port threads start
    
     // Find all suitable devices
 
-    pcap_if_t *all_devices, *next;
-    if (pcap_findalldevs(&all_devices, errbuf) == -1) {
+    pcap_if_t *all_devices = NULL, *next;
+    if (replay_files.empty() && pcap_findalldevs(&all_devices, errbuf) == -1) {
         fprintf(stderr, "pcap_findalldevs() error: %s\n", errbuf);
         return 1;
     }
@@ -55,9 +367,15 @@ int main() {
 
     CamTable camtable;
     IgmpTable igmptable;
-    vector<pthread_t*> threads;
+    MldTable mldtable;
+    Learner learner(&camtable, LEARN_QUEUE_LEN);
+    PacketPool pool(pool_buffers, port_config.ring_frame_size);
+    vector<pthread_t*> threads;     // RX threads
+    vector<pthread_t*> tx_threads;
     vector<Port*> ports;
     vector<PortThreadData*> thread_data_table;
+    EventEngine engine(engine_workers);
+    LatencyHistogram lat_base[LAT_HISTS];   // sums at last "lat reset"
     pthread_attr_t attr;
 
     // Prepare thread attributes
@@ -95,44 +413,178 @@ int main() {
 			continue;
 		}
 
-		// Create new port object
-        Port *port = new Port(next->name);
-        PortThreadData *tdata = new PortThreadData;
+		// Create new port object, its rings and queue are allocated on node of the interface
+        int node = port_numa_node(next->name);
+        set_memory_node(node);
+        Port *port = new Port(next->name, port_config);
+        set_memory_node(-1);
+        check_frame_size(next->name, port_config.ring_frame_size);
+        port->index = ports.size();
+        port->numa_node = node;
         ports.push_back(port);
-        thread_data_table.push_back(tdata);
-        
-        tdata->port = port;
-        tdata->camtable = &camtable;
-        tdata->igmptable = &igmptable;
-        
-        // Create new thread
-        pthread_t *thread = new pthread_t;
-        threads.push_back(thread);
 
-        ret = pthread_create(thread, &attr, port_thread, (void *) tdata);
-        if (ret) {
-            fprintf(stderr, "pthread_create() error: %d\n", ret);
+        next = next->next;
+    }
+
+    // Replay ports
+    for (size_t i=0; i < replay_files.size(); i++) {
+        string in_file = replay_files[i].substr(0, replay_files[i].find(':'));
+        string out_file = replay_files[i].substr(replay_files[i].find(':') + 1);
+        PortConfig file_config = port_config;
+        file_config.backend = PORT_BACKEND_FILE;
+
+        Port *port = new Port(in_file.c_str(), file_config);
+        port->index = ports.size();
+        ports.push_back(port);
+        if (port->open_files(in_file.c_str(), out_file.c_str()) < 0) {
+            return 1;
+        }
+    }
+    for (size_t i=0; i < fast_leave.size(); i++) {
+        bool found = false;
+        for (size_t j=0; j < ports.size(); j++) {
+            if (fast_leave[i] == "all" || fast_leave[i] == ports[j]->name) {
+                ports[j]->fast_leave = 1;
+                found = true;
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "Unknown port \"%s\" for fast leave\n", fast_leave[i].c_str());
             return 1;
         }
-        
-        next = next->next;
     }
     igmptable.set_ports(ports);
+    igmptable.set_pool(&pool);
+    igmptable.proxy_reporting = proxy_reporting;
+    mldtable.set_ports(ports);
     camtable.set_ports(ports);
+    learner.set_ports(ports);
+
+    // Create thread for every port (tables have to know all ports before first frame)
+    u_int64_t start_ns = mono_ns();
+
+    // Paced replay - all traces start at the time of the earliest frame
+    u_int64_t replay_base_ns = 0;
+    for (size_t i=0; i < ports.size(); i++) {
+        if (ports[i]->replay_first_ns && (!replay_base_ns || ports[i]->replay_first_ns < replay_base_ns)) {
+            replay_base_ns = ports[i]->replay_first_ns;
+        }
+    }
+    for (size_t i=0; i < ports.size(); i++) {
+        ports[i]->replay_base_ns = replay_base_ns;
+        ports[i]->replay_start_ns = start_ns;
+    }
+    // Learner has to run before the first frame arrives
+    pthread_t learner_tid;
+    placement.set_attr(&attr, placement.housekeeping_cpus);
+    placement.add_report("learner", placement.housekeeping_cpus, -1);
+    ret = pthread_create(&learner_tid, &attr, learner_thread, (void *) &learner);
+    if (ret) {
+        fprintf(stderr, "pthread_create() error: %d\n", ret);
+        return 1;
+    }
+
+    for (size_t i=0; i < ports.size(); i++) {
+        pthread_t *thread;
+
+        // Receiving threads, each has own ring of the port
+        int node = ports[i]->numa_node;
+        for (unsigned int w=0; w < ports[i]->rx_workers; w++) {
+            // Thread data (burst, forwarding cache) is local to the thread
+            void *mem = numa_alloc(sizeof(PortThreadData), node);
+            if (!mem) {
+                fprintf(stderr, "Couldn't allocate thread data\n");
+                return 1;
+            }
+            PortThreadData *tdata = new (mem) PortThreadData;
+
+            tdata->port = ports[i];
+            tdata->worker = w;
+            tdata->cpu = engine_workers ? -1 : placement.rx_cpu(node);
+            tdata->camtable = &camtable;
+            tdata->igmptable = &igmptable;
+            tdata->mldtable = &mldtable;
+            tdata->learner = &learner;
+            tdata->pool = &pool;
+            tdata->ports = &ports;
+            tdata->rx_counter = &(ports[i]->rx_counter[w]);
+            thread_data_table.push_back(tdata);
+            if (engine_workers) {
+                continue;
+            }
+
+            // Create new thread
+            thread = new pthread_t;
+            threads.push_back(thread);
+
+            vector<int> cpu(1, tdata->cpu);
+            char name[64];
+            snprintf(name, sizeof(name), "%s/rx%u", ports[i]->name.c_str(), w);
+            placement.set_attr(&attr, cpu);
+            placement.add_report(name, cpu, node);
+            ret = pthread_create(thread, &attr, port_thread, (void *) tdata);
+            if (ret) {
+                fprintf(stderr, "pthread_create() error: %d\n", ret);
+                return 1;
+            }
+        }
+
+        if (engine_workers) {
+            continue;
+        }
+
+        // TX worker of the port
+        thread = new pthread_t;
+        tx_threads.push_back(thread);
+
+        placement.set_attr(&attr, placement.node_cpus(node));
+        placement.add_report(ports[i]->name + "/tx", placement.node_cpus(node), node);
+
+        ret = pthread_create(thread, &attr, port_tx_thread, (void *) ports[i]);
+        if (ret) {
+            fprintf(stderr, "pthread_create() error: %d\n", ret);
+            return 1;
+        }
+    }
+
+    if (engine_workers) {
+        if (engine.start(thread_data_table, placement, &attr) < 0) {
+            return 1;
+        }
+        g_engine = &engine;
+    }
 
-    g_camtable = &camtable;
     g_igmptable = &igmptable;
+    g_mldtable = &mldtable;
+    g_ports = &ports;
+    g_pool = &pool;
 
     // Setup cam table cleaner thread
     pthread_t cam_cleaner;
+    placement.set_attr(&attr, placement.housekeeping_cpus);
+    placement.add_report("cleaner", placement.housekeeping_cpus, -1);
     ret = pthread_create(&cam_cleaner, &attr, cam_cleaner_thread, (void *) NULL);
     if (ret) {
         fprintf(stderr, "pthread_create() error: %d\n", ret);
         return 1;
     }
+    placement.add_report("cli", placement.housekeeping_cpus, -1);
+    placement.print_report();
+
+    // Replay mode is not interactive - wait for end of all traces
+    if (!replay_files.empty()) {
+        void *result;
+        engine.wait_replay();
+        while (!threads.empty()) {
+            if ((ret = pthread_join(*(threads.back()), &result)) != 0) {
+                fprintf(stderr, "pthread_join() err %d\n", ret);
+            }
+            threads.pop_back();
+        }
+    }
 
     // Switch command line interface
-    while (1) {
+    while (replay_files.empty()) {
         char cmd[31];
         printf("switch> ");
         fflush(stdout);
@@ -146,14 +598,41 @@ int main() {
         } else if (!strcmp(cmd, "cam")) {
             camtable.print_table();
         } else if (!strcmp(cmd, "stat")) {
-            printf("Iface\tSent-B\tSent-frm\tRecv-B\tRecv-frm\n");
-            for (size_t i=0; i < ports.size(); i++) {
-                ports[i]->print_stat();
+            print_stat(ports, pool);
+            learner.print_stat();
+            print_worker_stat(thread_data_table);
+            print_cache_stat(thread_data_table);
+            if (engine_workers) {
+                engine.print_stat();
+            }
+            camtable.lock_stat.print("CAM");
+            igmptable.lock_stat.print("IGMP");
+            mldtable.lock_stat.print("MLD");
+        } else if (!strcmp(cmd, "lat")) {
+            // Optional argument on the same line
+            char line[64];
+            char arg[31] = "";
+            if (fgets(line, sizeof(line), stdin)) {
+                sscanf(line, "%30s", arg);
+            }
+            if (!arg[0]) {
+                print_latency(thread_data_table, ports, lat_base);
+            } else if (!strcmp(arg, "reset")) {
+                collect_latency(thread_data_table, ports, lat_base);
+            } else if (!strcmp(arg, "on") || !strcmp(arg, "off")) {
+                __atomic_store_n(&hist_enabled, !strcmp(arg, "on"), __ATOMIC_RELAXED);
+                if (!LATENCY_HIST) {
+                    printf("Latency histograms are compiled out (build with HIST=1)\n");
+                }
+            } else {
+                printf("Usage: lat [reset|on|off]\n");
             }
         } else if (!strcmp(cmd, "igmp")) {
             igmptable.print_table();
+        } else if (!strcmp(cmd, "mld")) {
+            mldtable.print_table();
         } else if (!strcmp(cmd, "help")) {
-            printf("Supported commands are: quit, cam, stat, igmp, help\n");
+            printf("Supported commands are: quit, cam, stat, lat [reset|on|off], igmp, mld, help\n");
         } else {
             printf("Unknown command \"%s\" (try help)\n", cmd);
         }
@@ -166,10 +645,10 @@ int main() {
 
     // Tell all threads to stop
     for (unsigned int i=0; i < ports.size(); i++) {
-        pcap_breakloop(ports[i]->descriptor);
+        ports[i]->stop();
     }
 
-    // Join all threads
+    // Join all threads (TX workers exit when their egress queue is drained)
     void *result;
     while (!threads.empty()) {
         if ((ret = pthread_join(*(threads.back()), &result)) != 0) {
@@ -177,12 +656,34 @@ int main() {
         }
         threads.pop_back();
     }
+    if (engine_workers) {
+        engine.stop();
+    }
+    learner.stop();
+    if ((ret = pthread_join(learner_tid, &result)) != 0) {
+        fprintf(stderr, "pthread_join() err %d\n", ret);
+    }
+    while (!tx_threads.empty()) {
+        if ((ret = pthread_join(*(tx_threads.back()), &result)) != 0) {
+            fprintf(stderr, "pthread_join() err %d\n", ret);
+        }
+        tx_threads.pop_back();
+    }
+
+    if (!replay_files.empty()) {
+        replay_report(ports, pool, (mono_ns() - start_ns) / 1e9);
+        print_cache_stat(thread_data_table);
+        if (hist_on()) {
+            print_latency(thread_data_table, ports, lat_base);
+        }
+    }
 
     if ((ret = pthread_join(cam_cleaner, &result)) != 0) {
         fprintf(stderr, "pthread_join() err %d\n", ret);
     }
     
     pthread_attr_destroy(&attr);
+    rcu_reclaim_all();
 
     while (!ports.empty()) {
         delete ports.back();
@@ -190,11 +691,14 @@ int main() {
     }
 
     while (!thread_data_table.empty()) {
-        delete thread_data_table.back();
+        thread_data_table.back()->~PortThreadData();
+        numa_free(thread_data_table.back(), sizeof(PortThreadData));
         thread_data_table.pop_back();
     }
 
-	pcap_freealldevs(all_devices);
+	if (all_devices) {
+		pcap_freealldevs(all_devices);
+	}
 
     return 0;
 }
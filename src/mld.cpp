@@ -0,0 +1,449 @@
+#include <new>
+#include <cstdio>
+#include <string.h>
+#include <stdlib.h>
+#include <linux/if_ether.h>
+#include <netinet/ip6.h>
+#include <arpa/inet.h>
+#include "mld.h"
+#include "rcu.h"
+
+
+#define IPV6_NEXTHDR_HOP        0
+#define IPV6_NEXTHDR_ROUTING    43
+#define IPV6_NEXTHDR_DEST       60
+#define IPV6_NEXTHDR_ICMP       58
+
+#define MLD_QUERY           130
+#define MLD_V1_REPORT       131
+#define MLD_V1_DONE         132
+#define MLD_V2_REPORT       143
+
+// MLDv2 multicast address record types
+#define MLD2_MODE_IS_INCLUDE    1
+#define MLD2_MODE_IS_EXCLUDE    2
+#define MLD2_CHANGE_TO_INCLUDE  3
+#define MLD2_CHANGE_TO_EXCLUDE  4
+#define MLD2_ALLOW_NEW_SOURCES  5
+
+#define MLD_MSG_LEN         24      // query, MLDv1 report and done
+#define MLD2_RECORD_LEN     20      // record without sources
+
+// Aging timer id: group id in high bits, port index + 1 in low 16 bits
+#define MLD_TIMER_ID(rec, index) (((rec)->id << 16) | ((index) + 1))
+
+
+static inline u_int64_t port_bit(Port *port)
+{
+    return (port && port->index < IGMP_MAX_PORTS) ? (1ULL << port->index) : 0;
+}
+
+
+// Low 32 bits of group address in the order of the 33:33 MAC bytes
+static inline u_int32_t group_mac(const struct in6_addr *group)
+{
+    const u_int8_t *a = group->s6_addr;
+    return ((u_int32_t) a[12] << 24) | (a[13] << 16) | (a[14] << 8) | a[15];
+}
+
+
+// Interface and link scope groups (ff01::/16, ff02::/16 - all-nodes,
+// solicited-node groups of Neighbor Discovery) are always flooded
+static inline bool is_link_scope(const u_int8_t *a)
+{
+    return (a[1] & 0x0f) <= 2;
+}
+
+
+bool MldKey::operator<(const MldKey &other) const
+{
+    if (this->mac != other.mac) {
+        return this->mac < other.mac;
+    }
+    return memcmp(&(this->group), &(other.group), sizeof(this->group)) < 0;
+}
+
+
+MldTable::MldTable()
+{
+    pthread_mutex_init(&(this->mutex), NULL);
+    this->next_id = 0;
+    this->macs = mcast_mac_alloc(MLD_MAC_SLOTS);
+    this->queriers = 0;
+}
+
+
+MldTable::~MldTable()
+{
+    for (map<MldKey, MldRecord*>::iterator it = this->groups.begin(); it != this->groups.end(); it++) {
+        delete it->second;
+    }
+    free(this->macs);
+    pthread_mutex_destroy(&(this->mutex));
+}
+
+
+void MldTable::set_ports(vector<Port*> ports)
+{
+    this->ports = ports;
+    if (ports.size() > IGMP_MAX_PORTS) {
+        fprintf(stderr, "MLD snooping works only on first %d ports\n", IGMP_MAX_PORTS);
+    }
+}
+
+
+// Caller holds the mutex
+MldRecord *MldTable::find_record(const struct in6_addr *group)
+{
+    MldKey key;
+    key.mac = group_mac(group);
+    key.group = *group;
+    map<MldKey, MldRecord*>::iterator it = this->groups.find(key);
+    return it != this->groups.end() ? it->second : NULL;
+}
+
+
+// Caller holds the mutex
+void MldTable::remove_record(MldRecord *rec)
+{
+    MldKey key;
+    key.mac = group_mac(&(rec->group));
+    key.group = rec->group;
+    this->groups.erase(key);
+    this->timers.erase(rec->id);
+    delete rec;
+    update_mac(key.mac);
+}
+
+
+// Caller holds the mutex. Recomputes the MAC entry from all groups mapped
+// to the MAC.
+void MldTable::update_mac(u_int32_t mac)
+{
+    u_int64_t ports = 0;
+    MldKey key;
+    key.mac = mac;
+    memset(&(key.group), 0, sizeof(key.group));
+
+    map<MldKey, MldRecord*>::iterator it = this->groups.lower_bound(key);
+    for (; it != this->groups.end() && it->first.mac == mac; it++) {
+        ports |= it->second->ports;
+    }
+
+    McastMacEntry *entry = mcast_mac_find(this->macs, mac);
+    if (!entry) {
+        if (!ports) {
+            return;
+        }
+        entry = mcast_mac_insert(&(this->macs), mac);
+    }
+
+    // Readers check state first - ports are written before the entry becomes usable
+    if (!ports) {
+        __atomic_store_n(&(entry->state), MAC_ENTRY_NONE, __ATOMIC_RELEASE);
+    } else {
+        __atomic_store_n(&(entry->ports), ports, __ATOMIC_RELAXED);
+        __atomic_store_n(&(entry->state), MAC_ENTRY_PORTS, __ATOMIC_RELEASE);
+    }
+}
+
+
+void MldTable::add_listener(const struct in6_addr *group, Port *port)
+{
+    u_int64_t bit = port_bit(port);
+    const u_int8_t *a = group->s6_addr;
+    if (bit == 0 || a[0] != 0xff || is_link_scope(a)) {
+        // Not a snoopable group (interface or link scope)
+        return;
+    }
+
+    lock_acquire(&(this->mutex), &(this->lock_stat));
+    MldRecord *rec = find_record(group);
+    if (rec == NULL) {
+        rec = new MldRecord;
+        rec->group = *group;
+        rec->id = ++(this->next_id);
+        rec->ports = 0;
+        MldKey key;
+        key.mac = group_mac(group);
+        key.group = *group;
+        this->groups[key] = rec;
+        this->timers[rec->id] = rec;
+    }
+
+    // Add listener or refresh if exists
+    u_int32_t now = coarse_time();
+    rec->last_used[port->index] = now;
+    if (!(rec->ports & bit)) {
+        rec->ports |= bit;
+        rec->timer[port->index] = now + MLD_LISTENER_TIMEOUT + 1;
+        this->wheel.add(MLD_TIMER_ID(rec, port->index), rec->timer[port->index]);
+        update_mac(group_mac(group));
+    }
+
+    pthread_mutex_unlock(&(this->mutex));
+}
+
+
+// Fast leave port is pruned at once, other ports stay listeners only if a
+// report comes within MLD_LAST_LISTENER_TIME (answer to the multicast address
+// specific query of the router, which is forwarded to the listener ports)
+void MldTable::remove_listener(const struct in6_addr *group, Port *port)
+{
+    u_int64_t bit = port_bit(port);
+
+    lock_acquire(&(this->mutex), &(this->lock_stat));
+    MldRecord *rec = find_record(group);
+    if (rec != NULL && (rec->ports & bit)) {
+        if (!port->fast_leave) {
+            // Listener expires as if its last report came MLD_LAST_LISTENER_TIME before timeout
+            u_int32_t now = coarse_time();
+            rec->last_used[port->index] = now - MLD_LISTENER_TIMEOUT + MLD_LAST_LISTENER_TIME;
+            rec->timer[port->index] = now + MLD_LAST_LISTENER_TIME + 1;
+            this->wheel.add(MLD_TIMER_ID(rec, port->index), rec->timer[port->index]);
+        } else {
+            rec->ports &= ~bit;
+            if (rec->ports) {
+                update_mac(group_mac(group));
+            } else {
+                // Last listener left
+                remove_record(rec);
+            }
+        }
+    }
+    pthread_mutex_unlock(&(this->mutex));
+}
+
+
+void MldTable::add_querier(Port *port)
+{
+    u_int64_t bit = port_bit(port);
+    if (bit && !(__atomic_load_n(&(this->queriers), __ATOMIC_RELAXED) & bit)) {
+        __atomic_fetch_or(&(this->queriers), bit, __ATOMIC_RELAXED);
+    }
+}
+
+
+u_int64_t MldTable::group_ports(const struct in6_addr *group)
+{
+    lock_acquire(&(this->mutex), &(this->lock_stat));
+    MldRecord *rec = find_record(group);
+    u_int64_t ports = rec ? rec->ports : 0;
+    pthread_mutex_unlock(&(this->mutex));
+    return ports;
+}
+
+
+u_int64_t MldTable::mac_ports(u_int32_t mac)
+{
+    McastMacTable *table = __atomic_load_n(&(this->macs), __ATOMIC_ACQUIRE);
+    McastMacEntry *entry = mcast_mac_find(table, mac);
+    if (entry && __atomic_load_n(&(entry->state), __ATOMIC_ACQUIRE) == MAC_ENTRY_PORTS) {
+        return __atomic_load_n(&(entry->ports), __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+
+// Returns MULT_ERR if the message is truncated
+int MldTable::process_mld_packet(Port *source_port, const u_int8_t *icmp, size_t len, u_int64_t *egress)
+{
+    struct in6_addr group;
+    u_int64_t queriers = __atomic_load_n(&(this->queriers), __ATOMIC_RELAXED);
+
+    if (icmp[0] == MLD_QUERY) {
+        if (len < MLD_MSG_LEN) {
+            return MULT_ERR;
+        }
+        add_querier(source_port);
+        memcpy(&group, icmp + 8, sizeof(group));
+        if (IN6_IS_ADDR_UNSPECIFIED(&group)) {
+            // General query
+            return MULT_BROADCAST;
+        }
+        if (is_link_scope(group.s6_addr)) {
+            // Listeners of link scope groups are not tracked
+            return MULT_BROADCAST;
+        }
+        // Multicast address specific query
+        *egress = group_ports(&group);
+        return MULT_OK;
+    }
+
+    if (icmp[0] == MLD_V1_REPORT || icmp[0] == MLD_V1_DONE) {
+        if (len < MLD_MSG_LEN) {
+            return MULT_ERR;
+        }
+        memcpy(&group, icmp + 8, sizeof(group));
+        if (icmp[0] == MLD_V1_REPORT) {
+            add_listener(&group, source_port);
+        } else {
+            remove_listener(&group, source_port);
+        }
+        // Reports go only to multicast routers
+        *egress = queriers;
+        return MULT_OK;
+    }
+
+    // MLDv2 report - every record is a join or a leave of its group
+    if (len < 8) {
+        return MULT_ERR;
+    }
+    unsigned int records = (icmp[6] << 8) | icmp[7];
+    size_t off = 8;
+    for (unsigned int i=0; i < records; i++) {
+        if (off + MLD2_RECORD_LEN > len) {
+            return MULT_ERR;
+        }
+        const u_int8_t *rec = icmp + off;
+        unsigned int sources = (rec[2] << 8) | rec[3];
+        off += MLD2_RECORD_LEN + sources * sizeof(struct in6_addr) + rec[1] * 4;
+        if (off > len) {
+            return MULT_ERR;
+        }
+
+        memcpy(&group, rec + 4, sizeof(group));
+        if (rec[0] == MLD2_MODE_IS_EXCLUDE || rec[0] == MLD2_CHANGE_TO_EXCLUDE
+            || (sources && (rec[0] == MLD2_MODE_IS_INCLUDE || rec[0] == MLD2_CHANGE_TO_INCLUDE
+                            || rec[0] == MLD2_ALLOW_NEW_SOURCES))) {
+            add_listener(&group, source_port);
+        } else if (!sources && (rec[0] == MLD2_MODE_IS_INCLUDE || rec[0] == MLD2_CHANGE_TO_INCLUDE)) {
+            // INCLUDE with no sources = leave
+            remove_listener(&group, source_port);
+        }
+    }
+    *egress = queriers;
+    return MULT_OK;
+}
+
+
+int MldTable::process_multicast_packet(Port *source_port, PacketBuf *buf, u_int64_t *egress)
+{
+    const u_int8_t *packet = buf->data;
+    size_t size = buf->len;
+    struct ethhdr *eth_hdr = (struct ethhdr *) packet;
+
+    *egress = 0;
+    if (ntohs(eth_hdr->h_proto) != ETH_P_IPV6) {
+        // 33:33 MAC but not IPv6
+        return MULT_BROADCAST;
+    }
+
+    if (sizeof(struct ethhdr) + sizeof(struct ip6_hdr) > size) {
+        // Bad packet
+        return MULT_ERR;
+    }
+
+    struct ip6_hdr *ip6 = (struct ip6_hdr *) (packet + sizeof(struct ethhdr));
+
+    // MLD messages follow the hop-by-hop options (router alert)
+    u_int8_t next = ip6->ip6_nxt;
+    size_t off = sizeof(struct ethhdr) + sizeof(struct ip6_hdr);
+    while (next == IPV6_NEXTHDR_HOP || next == IPV6_NEXTHDR_DEST || next == IPV6_NEXTHDR_ROUTING) {
+        if (off + 2 > size) {
+            return MULT_ERR;
+        }
+        next = packet[off];
+        off += (packet[off + 1] + 1) * 8;
+    }
+
+    if (next == IPV6_NEXTHDR_ICMP && off < size) {
+        u_int8_t type = packet[off];
+        if (type == MLD_QUERY || type == MLD_V1_REPORT || type == MLD_V1_DONE || type == MLD_V2_REPORT) {
+            return process_mld_packet(source_port, packet + off, size - off, egress);
+        }
+    }
+
+    if (is_link_scope(ip6->ip6_dst.s6_addr)) {
+        return MULT_BROADCAST;
+    }
+
+    // Data - listeners of the destination MAC and multicast routers. Without
+    // a querier listeners are not refreshed, so unregistered groups are
+    // flooded (RFC 4541)
+    u_int64_t ports = mac_ports(group_mac(&(ip6->ip6_dst)));
+    u_int64_t queriers = __atomic_load_n(&(this->queriers), __ATOMIC_RELAXED);
+    if (!ports && !queriers) {
+        return MULT_BROADCAST;
+    }
+    *egress = ports | queriers;
+    return MULT_OK;
+}
+
+
+void MldTable::print_table()
+{
+    char addr[INET6_ADDRSTRLEN];
+
+    printf("GroupAddr\tIfaces\n");
+
+    lock_acquire(&(this->mutex), &(this->lock_stat));
+
+    u_int64_t queriers = __atomic_load_n(&(this->queriers), __ATOMIC_RELAXED);
+    for (map<MldKey, MldRecord*>::iterator it = this->groups.begin(); it != this->groups.end(); it++) {
+        MldRecord *rec = it->second;
+        inet_ntop(AF_INET6, &(rec->group), addr, sizeof(addr));
+        printf("%s\t", addr);
+        bool first = true;
+        for (size_t j=0; j < this->ports.size() && j < IGMP_MAX_PORTS; j++) {
+            if (queriers & (1ULL << j)) {
+                printf("%s*%s", first ? "" : ", ", this->ports[j]->name.c_str());
+                first = false;
+            }
+        }
+        for (size_t j=0; j < this->ports.size() && j < IGMP_MAX_PORTS; j++) {
+            if (rec->ports & (1ULL << j)) {
+                printf("%s%s", first ? "" : ", ", this->ports[j]->name.c_str());
+                first = false;
+            }
+        }
+        printf("\n");
+    }
+
+    pthread_mutex_unlock(&(this->mutex));
+}
+
+
+// Handle one expired timer, caller holds the mutex. Timers of listeners
+// that left or were re-armed meanwhile are stale and ignored.
+void MldTable::expire_timer(WheelTimer &timer, u_int32_t now)
+{
+    map<u_int64_t, MldRecord*>::iterator it = this->timers.find(timer.id >> 16);
+    if (it == this->timers.end()) {
+        return;
+    }
+    MldRecord *rec = it->second;
+
+    unsigned int index = (timer.id & 0xffff) - 1;
+    if (index >= IGMP_MAX_PORTS || !(rec->ports & (1ULL << index)) || rec->timer[index] != timer.expires) {
+        return;
+    }
+
+    if ((int32_t) (now - rec->last_used[index]) > MLD_LISTENER_TIMEOUT) {
+        rec->ports &= ~(1ULL << index);
+        if (rec->ports) {
+            update_mac(group_mac(&(rec->group)));
+        } else {
+            // Last listener expired -> remove empty group
+            remove_record(rec);
+        }
+    } else {
+        // Listener was refreshed - wait for the rest of its timeout
+        rec->timer[index] = rec->last_used[index] + MLD_LISTENER_TIMEOUT + 1;
+        this->wheel.add(timer.id, rec->timer[index]);
+    }
+}
+
+
+void MldTable::purge()
+{
+    vector<WheelTimer> expired;
+    u_int32_t now = coarse_time();
+
+    lock_acquire(&(this->mutex), &(this->lock_stat));
+    this->wheel.advance(now, expired);
+    for (size_t i=0; i < expired.size(); i++) {
+        expire_timer(expired[i], now);
+    }
+    pthread_mutex_unlock(&(this->mutex));
+}
@@ -0,0 +1,80 @@
+#ifndef __SWITCH_MLD_H__
+#define __SWITCH_MLD_H__
+
+#include <map>
+#include <vector>
+#include <netinet/in.h>
+#include "port.h"
+#include "aging.h"
+#include "lockstat.h"
+#include "igmp.h"
+
+using namespace std;
+
+#define MLD_LISTENER_TIMEOUT    260     // s, multicast listener interval (RFC 3810 defaults)
+#define MLD_LAST_LISTENER_TIME  2       // s, listener which sent done is kept for a query response
+#define MLD_MAC_SLOTS           1024    // initial size of the IPv6 multicast MAC hash (power of two)
+
+
+// Groups are ordered by the low 32 bits of the address (the part that
+// maps to the 33:33 MAC), so all groups sharing a MAC are neighbours
+class MldKey {
+    public:
+        u_int32_t mac;
+        struct in6_addr group;
+
+        bool operator<(const MldKey &other) const;
+};
+
+
+// Control plane state of a group, protected by MldTable mutex
+class MldRecord {
+    public:
+        struct in6_addr group;
+        u_int64_t id;                           // aging timer id of the group
+        u_int64_t ports;                        // bitmap of listener port indexes
+        u_int32_t last_used[IGMP_MAX_PORTS];    // time of last listener report of port
+        u_int32_t timer[IGMP_MAX_PORTS];        // expiry of the armed aging timer of port
+};
+
+
+// MLDv1/MLDv2 snooping. Listener reports and done messages are processed
+// under the mutex, data frames are forwarded by their 33:33 MAC from
+// McastMacTable without locking (groups sharing a MAC forward to union of
+// their listeners). Data goes to listeners and multicast router ports.
+class MldTable {
+    private:
+        pthread_mutex_t mutex;
+        map<MldKey, MldRecord*> groups;
+        map<u_int64_t, MldRecord*> timers;  // timer id -> group
+        u_int64_t next_id;
+        McastMacTable *macs;
+        u_int64_t queriers;     // bitmap of ports with multicast router
+        vector<Port*> ports;
+        TimingWheel wheel;      // aging timers of listeners, protected by mutex
+
+        MldRecord *find_record(const struct in6_addr *group);
+        void remove_record(MldRecord *rec);
+        void update_mac(u_int32_t mac);
+        void expire_timer(WheelTimer &timer, u_int32_t now);
+        int process_mld_packet(Port *source_port, const u_int8_t *icmp, size_t len, u_int64_t *egress);
+
+    public:
+        LockStat lock_stat; // contention of mutex
+
+        MldTable();
+        ~MldTable();
+        void add_listener(const struct in6_addr *group, Port *port);
+        void remove_listener(const struct in6_addr *group, Port *port);
+        void add_querier(Port *port);
+        u_int64_t group_ports(const struct in6_addr *group);    // bitmap of listener ports
+        u_int64_t mac_ports(u_int32_t mac);                     // lock free, listeners of groups mapped to MAC
+
+        void set_ports(vector<Port*> ports);
+        // Bitmap of ports the frame goes to is stored to egress (MULT_OK only)
+        int process_multicast_packet(Port *source_port, PacketBuf *buf, u_int64_t *egress);
+        void print_table();
+        void purge(); // remove expired listeners and empty groups
+};
+
+#endif /* __SWITCH_MLD_H__ */
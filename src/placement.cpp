@@ -0,0 +1,310 @@
+#include <cstdio>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "placement.h"
+
+using namespace std;
+
+
+// Number in the sysfs file, -1 if it can't be read
+static int read_sysfs_int(const char *path)
+{
+    int val = -1;
+    FILE *file = fopen(path, "r");
+    if (file) {
+        if (fscanf(file, "%d", &val) != 1) {
+            val = -1;
+        }
+        fclose(file);
+    }
+    return val;
+}
+
+
+int port_numa_node(const char *ifname)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", ifname);
+    // Virtual interfaces have no device, single node machines report -1
+    return read_sysfs_int(path);
+}
+
+
+int cpu_numa_node(int cpu)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return -1;
+    }
+
+    // Directory of the CPU contains link nodeN
+    int node = -1;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (!strncmp(entry->d_name, "node", 4) && sscanf(entry->d_name + 4, "%d", &node) == 1) {
+            break;
+        }
+        node = -1;
+    }
+    closedir(dir);
+    return node;
+}
+
+
+int parse_cpu_list(const char *str, vector<int> &cpus)
+{
+    char *end;
+    while (*str) {
+        long first = strtol(str, &end, 10);
+        long last = first;
+        if (end == str || first < 0) {
+            return -1;
+        }
+        if (*end == '-') {
+            str = end + 1;
+            last = strtol(str, &end, 10);
+            if (end == str || last < first) {
+                return -1;
+            }
+        }
+        if (last >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (long cpu=first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return -1;
+        }
+        str = end;
+    }
+    return cpus.empty() ? -1 : 0;
+}
+
+
+string format_cpu_list(const vector<int> &cpus)
+{
+    string str;
+    char buf[32];
+    for (size_t i=0; i < cpus.size(); ) {
+        // Run of consecutive CPUs
+        size_t j = i;
+        while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) {
+            j++;
+        }
+        if (j > i) {
+            snprintf(buf, sizeof(buf), "%s%d-%d", str.empty() ? "" : ",", cpus[i], cpus[j]);
+        } else {
+            snprintf(buf, sizeof(buf), "%s%d", str.empty() ? "" : ",", cpus[i]);
+        }
+        str += buf;
+        i = j + 1;
+    }
+    return str.empty() ? "-" : str;
+}
+
+
+// Node mask for the mempolicy syscalls (libnuma is not required)
+#define NODE_MASK_WORDS     4
+#define NODE_MASK_BITS      (NODE_MASK_WORDS * 8 * sizeof(unsigned long))
+
+static void node_mask(unsigned long *mask, int node)
+{
+    memset(mask, 0, NODE_MASK_WORDS * sizeof(unsigned long));
+    mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+}
+
+
+int set_memory_node(int node)
+{
+    unsigned long mask[NODE_MASK_WORDS];
+    long ret;
+
+    if (node < 0) {
+        ret = syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+    } else if ((size_t) node >= NODE_MASK_BITS) {
+        return -1;
+    } else {
+        node_mask(mask, node);
+        ret = syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, NODE_MASK_BITS + 1);
+    }
+    return ret < 0 ? -1 : 0;
+}
+
+
+void *numa_alloc(size_t size, int node)
+{
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return NULL;
+    }
+    if (node >= 0 && (size_t) node < NODE_MASK_BITS) {
+        // Nothing is touched yet, so every page follows the policy
+        unsigned long mask[NODE_MASK_WORDS];
+        node_mask(mask, node);
+        syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, mask, NODE_MASK_BITS + 1, 0);
+    }
+    return ptr;
+}
+
+
+void numa_free(void *ptr, size_t size)
+{
+    if (ptr) {
+        munmap(ptr, size);
+    }
+}
+
+
+
+Placement::Placement()
+{
+    this->enabled = false;
+}
+
+
+// Both sets are limited to CPUs the process may run on, a missing set is
+// the rest of them
+int Placement::setup(const vector<int> &data, const vector<int> &housekeeping)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        perror("sched_getaffinity()");
+        return -1;
+    }
+
+    vector<int> hk, dt;
+    for (size_t i=0; i < housekeeping.size(); i++) {
+        if (CPU_ISSET(housekeeping[i], &allowed)) {
+            hk.push_back(housekeeping[i]);
+        }
+    }
+    for (size_t i=0; i < data.size(); i++) {
+        if (CPU_ISSET(data[i], &allowed)) {
+            dt.push_back(data[i]);
+        }
+    }
+    if (data.empty() || housekeeping.empty()) {
+        const vector<int> &given = data.empty() ? hk : dt;
+        vector<int> &rest = data.empty() ? dt : hk;
+        for (int cpu=0; cpu < CPU_SETSIZE; cpu++) {
+            bool used = false;
+            for (size_t i=0; i < given.size(); i++) {
+                used = used || given[i] == cpu;
+            }
+            if (CPU_ISSET(cpu, &allowed) && !used) {
+                rest.push_back(cpu);
+            }
+        }
+        if (rest.empty()) {
+            // Single CPU - share it
+            rest = given;
+        }
+    }
+    if (dt.empty() || hk.empty()) {
+        fprintf(stderr, "No usable %s CPU\n", dt.empty() ? "data" : "housekeeping");
+        return -1;
+    }
+
+    this->data_cpus = dt;
+    this->housekeeping_cpus = hk;
+    this->data_nodes.clear();
+    for (size_t i=0; i < dt.size(); i++) {
+        this->data_nodes.push_back(cpu_numa_node(dt[i]));
+    }
+    this->load.assign(dt.size(), 0);
+    this->enabled = true;
+    return 0;
+}
+
+
+int Placement::rx_cpu(int node)
+{
+    if (!this->enabled) {
+        return -1;
+    }
+
+    // Receive threads are spread before any CPU gets second one, local CPU wins a tie
+    size_t best = 0;
+    for (size_t i=1; i < this->data_cpus.size(); i++) {
+        bool local = node >= 0 && this->data_nodes[i] == node;
+        bool best_local = node >= 0 && this->data_nodes[best] == node;
+        if (this->load[i] < this->load[best] || (this->load[i] == this->load[best] && local && !best_local)) {
+            best = i;
+        }
+    }
+    this->load[best]++;
+    return this->data_cpus[best];
+}
+
+
+vector<int> Placement::node_cpus(int node)
+{
+    vector<int> cpus;
+    for (size_t i=0; i < this->data_cpus.size(); i++) {
+        if (this->data_nodes[i] == node) {
+            cpus.push_back(this->data_cpus[i]);
+        }
+    }
+    return cpus.empty() ? this->data_cpus : cpus;
+}
+
+
+int Placement::set_attr(pthread_attr_t *attr, const vector<int> &cpus)
+{
+    if (!this->enabled || cpus.empty()) {
+        return 0;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i=0; i < cpus.size(); i++) {
+        CPU_SET(cpus[i], &set);
+    }
+    return pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+
+int Placement::bind_self(const vector<int> &cpus)
+{
+    if (!this->enabled || cpus.empty()) {
+        return 0;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i=0; i < cpus.size(); i++) {
+        CPU_SET(cpus[i], &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+
+void Placement::add_report(const string &thread, const vector<int> &cpus, int node)
+{
+    char line[128];
+    char node_str[16] = "-";
+    if (node >= 0) {
+        snprintf(node_str, sizeof(node_str), "%d", node);
+    }
+    snprintf(line, sizeof(line), "%-16s %-12s %s", thread.c_str(),
+             this->enabled ? format_cpu_list(cpus).c_str() : "any", node_str);
+    this->report.push_back(line);
+}
+
+
+void Placement::print_report()
+{
+    printf("%-16s %-12s %s\n", "Thread", "CPUs", "Node");
+    for (size_t i=0; i < this->report.size(); i++) {
+        printf("%s\n", this->report[i].c_str());
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef __SWITCH_PLACEMENT_H__
+#define __SWITCH_PLACEMENT_H__
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <sys/types.h>
+
+
+// NUMA node of the network interface (from sysfs), -1 if unknown
+int port_numa_node(const char *ifname);
+// NUMA node of the CPU, -1 if unknown
+int cpu_numa_node(int cpu);
+
+// Parse CPU list like "0-3,6" (appended to cpus), -1 on error
+int parse_cpu_list(const char *str, std::vector<int> &cpus);
+std::string format_cpu_list(const std::vector<int> &cpus);
+
+// Memory allocated by the calling thread comes preferably from node
+// (-1 = default policy of the process). Used while objects of one port
+// are created, so that its rings and queues are local to the interface.
+int set_memory_node(int node);
+// Page aligned zeroed memory whose pages are allocated on node when touched
+void *numa_alloc(size_t size, int node);
+void numa_free(void *ptr, size_t size);
+
+
+// CPUs of the switch threads. Receive threads of a port get their own
+// data CPU, preferably one on the NUMA node of the interface, TX workers
+// share the data CPUs of that node. Cleaner, learner and the command line
+// run on housekeeping CPUs, so they never preempt the data path.
+// Placement is enabled by giving data or housekeeping CPUs, the other set
+// is the rest of the CPUs the process may run on.
+class Placement {
+    private:
+        std::vector<int> data_cpus;
+        std::vector<int> data_nodes;        // node of data CPU on same index
+        std::vector<unsigned int> load;     // receive threads bound to data CPU on same index
+        std::vector<std::string> report;
+
+    public:
+        bool enabled;
+        std::vector<int> housekeeping_cpus;
+
+        Placement();
+        int setup(const std::vector<int> &data, const std::vector<int> &housekeeping); // -1 if no CPU is left for a set
+        int rx_cpu(int node);                       // least loaded data CPU preferring node, -1 if disabled
+        std::vector<int> node_cpus(int node);       // data CPUs of node, all data CPUs if node has none
+        int set_attr(pthread_attr_t *attr, const std::vector<int> &cpus); // threads created with attr run on cpus
+        int bind_self(const std::vector<int> &cpus);
+        void add_report(const std::string &thread, const std::vector<int> &cpus, int node);
+        void print_report();
+};
+
+#endif /* __SWITCH_PLACEMENT_H__ */
@@ -0,0 +1,144 @@
+#include <new>
+#include <cstdio>
+#include <stdlib.h>
+#include <string.h>
+#include "pool.h"
+#include "aging.h"
+
+
+static void update_max(u_int64_t *max_ns, u_int64_t val)
+{
+    u_int64_t max = __atomic_load_n(max_ns, __ATOMIC_RELAXED);
+    while (val > max && !__atomic_compare_exchange_n(max_ns, &max, val, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+
+// Queue length has to be power of two
+static unsigned int pow2(unsigned int count)
+{
+    unsigned int len = 1;
+    while (len < count) {
+        len <<= 1;
+    }
+    return len;
+}
+
+
+PacketPool::PacketPool(unsigned int count, unsigned int max_frame) : free_bufs(pow2(count))
+{
+    this->count = count;
+    this->max_frame = max_frame;
+    this->buf_size = (sizeof(PacketBuf) + max_frame + 63) & ~63UL;
+    if (posix_memalign((void **) &(this->bufs), 64, this->buf_size * count)) {
+        throw std::bad_alloc();
+    }
+    for (unsigned int i=0; i < count; i++) {
+        PacketBuf *buf = (PacketBuf *) (this->bufs + i * this->buf_size);
+        buf->pool = this;
+        buf->index = i;
+        buf->refcnt = 0;
+        this->free_bufs.enqueue(buf);
+    }
+    this->exhausted = 0;
+    this->oversize = 0;
+    this->oversize_warned = 0;
+    this->oversize_warn_time = 0;
+    this->sampled = 0;
+    this->lifetime_ns = 0;
+    this->lifetime_max_ns = 0;
+    this->latency_sampled = 0;
+    this->latency_ns = 0;
+    this->latency_max_ns = 0;
+}
+
+
+PacketPool::~PacketPool()
+{
+    free(this->bufs);
+}
+
+
+PacketBuf *PacketPool::alloc(const void *data, size_t size)
+{
+    PacketBuf *buf;
+
+    if (size > this->max_frame) {
+        __atomic_fetch_add(&(this->oversize), 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    if ((buf = (PacketBuf *) this->free_bufs.dequeue()) == NULL) {
+        __atomic_fetch_add(&(this->exhausted), 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    buf->refcnt = 1;
+    buf->len = size;
+    buf->rx_ns = 0;
+    memcpy(buf->data, data, size);
+    if ((buf->index & POOL_SAMPLE_MASK) == 0) {
+        buf->alloc_ns = mono_ns();
+    }
+    return buf;
+}
+
+
+void PacketPool::release(PacketBuf *buf)
+{
+    if ((buf->index & POOL_SAMPLE_MASK) == 0) {
+        u_int64_t lifetime = mono_ns() - buf->alloc_ns;
+        __atomic_fetch_add(&(this->sampled), 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&(this->lifetime_ns), lifetime, __ATOMIC_RELAXED);
+        update_max(&(this->lifetime_max_ns), lifetime);
+
+        // Includes the wait for receive thread wakeup, unlike lifetime
+        if (buf->rx_ns) {
+            u_int64_t now = real_ns();
+            u_int64_t latency = now > buf->rx_ns ? now - buf->rx_ns : 0;
+            __atomic_fetch_add(&(this->latency_sampled), 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&(this->latency_ns), latency, __ATOMIC_RELAXED);
+            update_max(&(this->latency_max_ns), latency);
+        }
+    }
+    this->free_bufs.enqueue(buf);
+}
+
+
+unsigned int PacketPool::in_use()
+{
+    return this->count - this->free_bufs.depth();
+}
+
+
+// Receive offloads (GRO/LRO) make frames bigger than the MTU, which are
+// dropped silently otherwise
+void PacketPool::check_oversize(u_int32_t now)
+{
+    size_t oversize = __atomic_load_n(&(this->oversize), __ATOMIC_RELAXED);
+    if (oversize == this->oversize_warned
+        || (this->oversize_warned && now - this->oversize_warn_time < POOL_OVERSIZE_WARN)) {
+        return;
+    }
+    fprintf(stderr, "Warning: %zu frames bigger than %u B dropped as oversize"
+            " (raise -f or turn GRO/LRO off)\n", oversize - this->oversize_warned, this->max_frame);
+    this->oversize_warned = oversize;
+    this->oversize_warn_time = now;
+}
+
+
+void PacketPool::print_stat()
+{
+    size_t sampled = __atomic_load_n(&(this->sampled), __ATOMIC_RELAXED);
+    printf("Buffers: %u/%u in use, %zu allocation failures, lifetime avg %.1f us max %.1f us\n",
+           in_use(), this->count, __atomic_load_n(&(this->exhausted), __ATOMIC_RELAXED),
+           sampled ? this->lifetime_ns / 1000.0 / sampled : 0.0, this->lifetime_max_ns / 1000.0);
+    size_t oversize = __atomic_load_n(&(this->oversize), __ATOMIC_RELAXED);
+    if (oversize) {
+        printf("Oversize frames dropped: %zu (buffer holds %u B, see -f)\n", oversize, this->max_frame);
+    }
+    sampled = __atomic_load_n(&(this->latency_sampled), __ATOMIC_RELAXED);
+    if (sampled) {
+        printf("Receive to send latency: avg %.1f us max %.1f us (%zu frames sampled)\n",
+               this->latency_ns / 1000.0 / sampled, this->latency_max_ns / 1000.0, sampled);
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef __SWITCH_POOL_H__
+#define __SWITCH_POOL_H__
+
+#include <sys/types.h>
+#include "queue.h"
+
+#define POOL_DEF_BUFFERS    8192
+#define POOL_SAMPLE_MASK    63      // lifetime is measured on every 64th buffer
+#define POOL_OVERSIZE_WARN  60      // s, min time between warnings about dropped oversize frames
+
+
+class PacketPool;
+
+
+// Received frame shared by all egress queues it was put to. The buffer
+// returns to its pool when the last reference is dropped.
+class PacketBuf {
+    public:
+        PacketPool *pool;
+        u_int32_t index;        // position in the pool
+        u_int32_t refcnt;
+        u_int32_t len;
+        u_int64_t alloc_ns;     // only on sampled buffers
+        u_int64_t rx_ns;        // kernel receive timestamp (wall clock), 0 if unknown
+        u_int8_t data[] __attribute__((aligned(64)));
+};
+
+
+// Fixed set of packet buffers, free buffers are kept in lock free queue
+class PacketPool {
+    private:
+        u_int8_t *bufs;
+        size_t buf_size;
+        PtrQueue free_bufs;
+
+    public:
+        unsigned int count;
+        unsigned int max_frame;
+        size_t exhausted;       // failed allocations (frame dropped)
+        size_t oversize;        // frames bigger than max_frame (dropped, not an exhaustion)
+        size_t oversize_warned; // oversize count at the last warning
+        u_int32_t oversize_warn_time;
+        size_t sampled;         // number of measured buffer lifetimes
+        u_int64_t lifetime_ns;  // sum of measured lifetimes
+        u_int64_t lifetime_max_ns;
+        size_t latency_sampled; // sampled buffers with receive timestamp
+        u_int64_t latency_ns;   // sum of times from kernel receive to release (last send)
+        u_int64_t latency_max_ns;
+
+        PacketPool(unsigned int count, unsigned int max_frame);
+        ~PacketPool();
+        PacketBuf *alloc(const void *data, size_t size); // buffer with one reference, NULL if exhausted
+        void release(PacketBuf *buf);                    // return buffer to pool (called by packet_put)
+        unsigned int in_use();
+        void check_oversize(u_int32_t now); // periodically, warns if oversize frames were dropped
+        void print_stat();
+};
+
+
+static inline void packet_get(PacketBuf *buf)
+{
+    __atomic_fetch_add(&(buf->refcnt), 1, __ATOMIC_RELAXED);
+}
+
+
+static inline void packet_put(PacketBuf *buf)
+{
+    if (__atomic_sub_fetch(&(buf->refcnt), 1, __ATOMIC_ACQ_REL) == 0) {
+        buf->pool->release(buf);
+    }
+}
+
+#endif /* __SWITCH_POOL_H__ */
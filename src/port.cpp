@@ -1,86 +1,565 @@
+#include <new>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <linux/if_ether.h>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
 #include "port.h"
+#include "aging.h"
 
 using namespace std;
 
 
+PortConfig::PortConfig()
+{
+    this->backend = PORT_BACKEND_RING;
+    this->ring_block_size = RING_DEF_BLOCK_SIZE;
+    this->ring_block_nr = RING_DEF_BLOCK_NR;
+    this->ring_frame_size = RING_DEF_FRAME_SIZE;
+    this->ring_timeout = RING_DEF_TIMEOUT;
+    this->tx_batch = TX_DEF_BATCH;
+    this->tx_flush_us = TX_DEF_FLUSH_US;
+    this->queue_len = QUEUE_DEF_LEN;
+    this->rx_workers = PORT_DEF_RX_WORKERS;
+    this->busy_poll_us = 0;
+    this->replay_paced = 0;
+}
+
+
+
 Port::Port()
 {
-    pthread_mutex_init(&(this->mutex), NULL);
     this->name = "";
-    this->send_b = 0;
-    this->send_f = 0;
-    this->recv_b = 0;
-    this->recv_f = 0;
+    this->index = 0;
+    this->backend = PORT_BACKEND_PCAP;
+    this->stopped = 0;
+    this->descriptor = NULL;
+    this->rx_workers = 1;
+    this->busy_poll_us = 0;
+    this->dump_descriptor = NULL;
+    this->dumper = NULL;
+    this->vring = NULL;
+    this->vring_frame = 0;
+    this->vring_pos = 0;
+    this->replay_paced = 0;
+    this->replay_first_ns = 0;
+    this->replay_base_ns = 0;
+    this->replay_start_ns = 0;
+    this->numa_node = -1;
+    this->tx_rx_count = 0;
+    this->tx_drops = 0;
+    this->fast_leave = 0;
+    this->tx_batch = 1;
+    this->tx_flush_ns = 0;
+    this->queue = new EgressQueue(QUEUE_DEF_LEN);
+}
+
+
+Port::Port(const char *name, const PortConfig &config)
+{
+    this->name = name;
+    this->index = 0;
+    this->backend = config.backend;
+    this->stopped = 0;
     this->descriptor = NULL;
+    this->rx_workers = 1;
+    this->busy_poll_us = config.busy_poll_us;
+    this->dump_descriptor = NULL;
+    this->dumper = NULL;
+    this->vring = NULL;
+    this->vring_frame = 0;
+    this->vring_pos = 0;
+    this->replay_paced = config.replay_paced;
+    this->replay_first_ns = 0;
+    this->replay_base_ns = 0;
+    this->replay_start_ns = 0;
+    this->numa_node = -1;
+    this->tx_rx_count = 0;
+    this->tx_drops = 0;
+    this->fast_leave = 0;
+    this->tx_batch = config.tx_batch;
+    this->tx_flush_ns = (u_int64_t) config.tx_flush_us * 1000;
+    this->queue = new EgressQueue(config.queue_len);
+
+    if (this->backend == PORT_BACKEND_FILE) {
+        // Files are opened by open_files()
+        return;
+    }
+    if (this->backend == PORT_BACKEND_VIRTUAL) {
+        // Received frames are passed to handler() directly by the owner of the port
+        this->vring_frame = config.ring_frame_size;
+        if (posix_memalign((void **) &(this->vring), 64, (size_t) VPORT_RING_FRAMES * this->vring_frame)) {
+            throw std::bad_alloc();
+        }
+        return;
+    }
+
+    if (this->backend == PORT_BACKEND_RING) {
+        if (open_rings(name, config) == 0) {
+            if (this->tx_ring.open(name, config.ring_frame_size) < 0) {
+                fprintf(stderr, "Couldn't open transmit ring on %s, sending frame by frame\n", name);
+            }
+            return;
+        }
+        fprintf(stderr, "Couldn't open ring on %s, falling back to pcap\n", name);
+        this->backend = PORT_BACKEND_PCAP;
+    }
+
+    open_pcap(name);
 }
 
 
-Port::Port(const char *name)
+// Frames bigger than max_frame are dropped as oversize. Warn when the
+// interface can deliver them - MTU (with VLAN tag) above max_frame or
+// receive offload merging segments into frames up to 64 kB.
+void check_frame_size(const char *ifname, unsigned int max_frame)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        return;
+    }
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+
+    if (ioctl(fd, SIOCGIFMTU, &ifr) == 0 && (unsigned int) ifr.ifr_mtu + ETH_HLEN + 4 > max_frame) {
+        fprintf(stderr, "Warning: MTU %d of %s needs -f %u, bigger frames are dropped as oversize\n",
+                ifr.ifr_mtu, ifname, (ifr.ifr_mtu + ETH_HLEN + 4 + 15) & ~15U);
+    }
+
+    struct ethtool_value gro = { ETHTOOL_GGRO, 0 };
+    ifr.ifr_data = (char *) &gro;
+    bool offload = ioctl(fd, SIOCETHTOOL, &ifr) == 0 && gro.data;
+    struct ethtool_value flags = { ETHTOOL_GFLAGS, 0 };
+    ifr.ifr_data = (char *) &flags;
+    if (ioctl(fd, SIOCETHTOOL, &ifr) == 0 && (flags.data & ETH_FLAG_LRO)) {
+        offload = true;
+    }
+    if (offload) {
+        fprintf(stderr, "Warning: GRO/LRO is on on %s, merged frames bigger than %u B are dropped"
+                " as oversize (ethtool -K %s gro off lro off)\n", ifname, max_frame, ifname);
+    }
+    close(fd);
+}
+
+
+int Port::open_pcap(const char *name)
 {
     char errbuf[PCAP_ERRBUF_SIZE];	/* Error string */
 
-    pthread_mutex_init(&(this->mutex), NULL);
-    this->name = name;
-    this->send_b = 0;
-    this->send_f = 0;
-    this->recv_b = 0;
-    this->recv_f = 0;
+    if (this->busy_poll_us) {
+        return open_pcap_immediate(name);
+    }
+
     this->descriptor = pcap_open_live(name, BUFSIZ, 1, 50, errbuf);
     if (this->descriptor == NULL) {
 		fprintf(stderr, "Couldn't open device %s: %s\n", name, errbuf);
-		return;
+		return -1;
 	}
 	if (pcap_setdirection(this->descriptor, PCAP_D_IN)) {
     	fprintf(stderr, "Couldn't set right direction on %s descriptor\n", name);
-		return;
+		return -1;
 	}
+    return 0;
+}
+
+
+// Low latency mode - every frame is delivered at once (no read timeout
+// batching) and reads don't block, the port thread polls the descriptor
+int Port::open_pcap_immediate(const char *name)
+{
+    char errbuf[PCAP_ERRBUF_SIZE];	/* Error string */
+
+    this->descriptor = pcap_create(name, errbuf);
+    if (this->descriptor == NULL) {
+        fprintf(stderr, "Couldn't open device %s: %s\n", name, errbuf);
+        return -1;
+    }
+    pcap_set_snaplen(this->descriptor, BUFSIZ);
+    pcap_set_promisc(this->descriptor, 1);
+    pcap_set_immediate_mode(this->descriptor, 1);
+    if (pcap_activate(this->descriptor) < 0) {
+        fprintf(stderr, "Couldn't activate device %s: %s\n", name, pcap_geterr(this->descriptor));
+        pcap_close(this->descriptor);
+        this->descriptor = NULL;
+        return -1;
+    }
+    if (pcap_setdirection(this->descriptor, PCAP_D_IN)) {
+        fprintf(stderr, "Couldn't set right direction on %s descriptor\n", name);
+        return -1;
+    }
+    if (pcap_setnonblock(this->descriptor, 1, errbuf) < 0) {
+        fprintf(stderr, "Couldn't set non-blocking mode on %s: %s\n", name, errbuf);
+        return -1;
+    }
+
+    int fd = pcap_get_selectable_fd(this->descriptor);
+    int us = this->busy_poll_us;
+    if (fd >= 0 && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us)) < 0) {
+        perror("setsockopt(SO_BUSY_POLL)");
+    }
+    return 0;
+}
+
+
+// One ring per receiving thread. More rings join one fanout group, if the
+// kernel refuses it the port is served by the first ring only.
+int Port::open_rings(const char *name, const PortConfig &config)
+{
+    static unsigned int fanout_ports = 0;
+
+    if (this->rx_ring[0].open(name, config.ring_block_size, config.ring_block_nr,
+                              config.ring_frame_size, config.ring_timeout, config.busy_poll_us) < 0) {
+        return -1;
+    }
+    if (config.rx_workers <= 1) {
+        return 0;
+    }
+
+    // Group id is global in network namespace, make it differ from other switch processes
+    u_int16_t group = (getpid() + fanout_ports++) & 0xffff;
+    unsigned int i;
+    for (i=0; i < config.rx_workers && i < PORT_RX_COUNTERS; i++) {
+        if (i > 0 && this->rx_ring[i].open(name, config.ring_block_size, config.ring_block_nr,
+                                           config.ring_frame_size, config.ring_timeout, config.busy_poll_us) < 0) {
+            break;
+        }
+        if (this->rx_ring[i].join_fanout(group) < 0) {
+            break;
+        }
+    }
+    if (i < config.rx_workers) {
+        fprintf(stderr, "Couldn't spread %s over %u rings, using one receive thread\n", name, config.rx_workers);
+        // Sockets already in the group would get their share of frames, start over
+        for (; i > 0; i--) {
+            this->rx_ring[i].close();
+        }
+        this->rx_ring[0].close();
+        return this->rx_ring[0].open(name, config.ring_block_size, config.ring_block_nr,
+                                     config.ring_frame_size, config.ring_timeout, config.busy_poll_us);
+    }
+    this->rx_workers = config.rx_workers;
+    return 0;
+}
+
+
+// Input trace is read by the port thread, transmitted frames are appended
+// to the output file by the TX worker
+int Port::open_files(const char *in_file, const char *out_file)
+{
+    char errbuf[PCAP_ERRBUF_SIZE];	/* Error string */
+
+    this->descriptor = pcap_open_offline(in_file, errbuf);
+    if (this->descriptor == NULL) {
+        fprintf(stderr, "Couldn't open trace %s: %s\n", in_file, errbuf);
+        return -1;
+    }
+    if (pcap_datalink(this->descriptor) != DLT_EN10MB) {
+        fprintf(stderr, "Trace %s doesn't contain ethernet frames\n", in_file);
+        return -1;
+    }
+
+    // Peek at the first timestamp, paced replay of all traces shares one time base
+    pcap_t *peek = pcap_open_offline(in_file, errbuf);
+    if (peek) {
+        struct pcap_pkthdr *header;
+        const u_char *packet;
+        if (pcap_next_ex(peek, &header, &packet) == 1) {
+            this->replay_first_ns = (u_int64_t) header->ts.tv_sec * 1000000000ULL + header->ts.tv_usec * 1000ULL;
+        }
+        pcap_close(peek);
+    }
+
+    this->dump_descriptor = pcap_open_dead(DLT_EN10MB, 65535);
+    if (this->dump_descriptor == NULL) {
+        fprintf(stderr, "pcap_open_dead() error\n");
+        return -1;
+    }
+    this->dumper = pcap_dump_open(this->dump_descriptor, out_file);
+    if (this->dumper == NULL) {
+        fprintf(stderr, "Couldn't open output %s: %s\n", out_file, pcap_geterr(this->dump_descriptor));
+        return -1;
+    }
+    return 0;
 }
 
 
 Port::~Port()
 {
-    pthread_mutex_destroy(&(this->mutex));
+    delete this->queue;
+    free(this->vring);
+    if (this->dumper) {
+        pcap_dump_close(this->dumper);
+    }
+    if (this->dump_descriptor) {
+        pcap_close(this->dump_descriptor);
+    }
     if (this->descriptor) {
         pcap_close(this->descriptor);
     }
 }
 
 
-int Port::send(const void *buf, size_t size)
+int Port::send(PacketBuf *buf)
+{
+    packet_get(buf);
+    if (this->queue->enqueue(buf) < 0) {
+        packet_put(buf);
+        return -1;
+    }
+    return 0;
+}
+
+
+unsigned int Port::send_burst(PacketBuf **bufs, unsigned int n)
+{
+    for (unsigned int i=0; i < n; i++) {
+        packet_get(bufs[i]);
+    }
+    unsigned int done = this->queue->enqueue_bulk(bufs, n);
+    for (unsigned int i=done; i < n; i++) {
+        packet_put(bufs[i]);
+    }
+    return done;
+}
+
+
+// Called only from the TX worker
+void Port::transmit(const void *buf, size_t size)
 {
     int ret;
-    assert(this->descriptor);
+    u_int64_t start = 0;
 
-    pthread_mutex_lock(&(this->mutex));
-    ret = pcap_inject(this->descriptor, buf, size);
-    if (ret < 0) {
-        return ret;
+    if (this->tx_ring.fd >= 0) {
+        // Queue to transmit ring, counters are updated on flush
+        if (this->tx_ring.queue(buf, size) == 0) {
+            return;
+        }
+        flush();
+        if (this->tx_ring.queue(buf, size) == 0) {
+            return;
+        }
+        // Frame bigger than ring slot goes through the receive socket, send()
+        // on the TX ring socket would transmit the ring and ignore buf
+        start = hist_on() ? mono_ns() : 0;
+        ret = ::send(this->rx_ring[0].fd, buf, size, 0);
+    } else if (this->backend == PORT_BACKEND_RING) {
+        start = hist_on() ? mono_ns() : 0;
+        ret = ::send(this->rx_ring[0].fd, buf, size, 0);
+    } else if (this->backend == PORT_BACKEND_FILE) {
+        struct pcap_pkthdr header;
+        gettimeofday(&(header.ts), NULL);
+        header.caplen = size;
+        header.len = size;
+        pcap_dump((u_char *) this->dumper, &header, (const u_char *) buf);
+        ret = size;
+    } else if (this->backend == PORT_BACKEND_VIRTUAL) {
+        if (size > this->vring_frame) {
+            size = this->vring_frame;
+        }
+        memcpy(this->vring + (size_t) (this->vring_pos++ & (VPORT_RING_FRAMES - 1)) * this->vring_frame, buf, size);
+        ret = size;
+    } else {
+        assert(this->descriptor);
+        start = hist_on() ? mono_ns() : 0;
+        ret = pcap_inject(this->descriptor, buf, size);
     }
 
-    this->send_b += size;
-    this->send_f++;
-    pthread_mutex_unlock(&(this->mutex));
-    return ret;
+    if (start) {
+        this->tx_call_hist.record(mono_ns() - start);
+    }
+    if (ret >= 0) {
+        this->tx_counter.add(size, 1);
+    } else {
+        __atomic_store_n(&(this->tx_drops), this->tx_drops + 1, __ATOMIC_RELAXED);
+    }
+}
+
+
+void Port::flush()
+{
+    unsigned int frames;
+    unsigned int pending = this->tx_ring.pending;
+    u_int64_t start = hist_on() && pending ? mono_ns() : 0;
+    int ret = this->tx_ring.flush(&frames);
+    if (start) {
+        this->tx_call_hist.record(mono_ns() - start);
+    }
+    if (ret > 0) {
+        this->tx_counter.add(ret, frames);
+    }
+    if (frames < pending) {
+        __atomic_store_n(&(this->tx_drops), this->tx_drops + pending - frames, __ATOMIC_RELAXED);
+    }
+
+    // Frames of the batch are done now
+    if (this->tx_rx_count) {
+        u_int64_t now = real_ns();
+        for (unsigned int i=0; i < this->tx_rx_count; i++) {
+            this->forward_hist.record(now > this->tx_rx_ns[i] ? now - this->tx_rx_ns[i] : 0);
+        }
+        this->tx_rx_count = 0;
+    }
+}
+
+
+// Frame with receive time rx_ns was transmitted or queued to transmit ring
+void Port::tx_done(u_int64_t rx_ns)
+{
+    if (!rx_ns || !hist_on()) {
+        return;
+    }
+    if (this->tx_ring.pending && this->tx_rx_count < TX_RING_FRAMES) {
+        // Recorded on flush
+        this->tx_rx_ns[this->tx_rx_count++] = rx_ns;
+    } else {
+        // Sent already, or no room to keep the receive time - recorded now
+        // without the wait for flush rather than lost
+        u_int64_t now = real_ns();
+        this->forward_hist.record(now > rx_ns ? now - rx_ns : 0);
+    }
+}
+
+
+void Port::tx_loop()
+{
+    u_int64_t pending_since = 0;
+
+    while (1) {
+        PacketBuf *buf = this->queue->dequeue();
+        if (buf) {
+            transmit(buf->data, buf->len);
+            tx_done(buf->rx_ns);
+            packet_put(buf);
+            if (this->tx_ring.pending == 1 && this->tx_flush_ns) {
+                pending_since = mono_ns();
+            }
+            if (this->tx_ring.pending >= this->tx_batch) {
+                flush();
+            }
+            continue;
+        }
+
+        // Egress queue is drained
+        if (this->tx_ring.pending) {
+            u_int64_t waited = mono_ns() - pending_since;
+            if (!this->tx_flush_ns || waited >= this->tx_flush_ns) {
+                flush();
+            } else {
+                // Wait for more frames until flush deadline (short spin, then sleep)
+                this->queue->wait(this->tx_flush_ns - waited);
+            }
+            continue;
+        }
+
+        if (this->stopped) {
+            break;
+        }
+        this->queue->wait();
+    }
+}
+
+
+// TX side of the port served by an event engine worker. The transmit ring
+// is flushed before return (flush timeout -w doesn't apply), the worker
+// doesn't come back until something else happens.
+unsigned int Port::tx_poll(unsigned int budget)
+{
+    unsigned int n = 0;
+    PacketBuf *buf;
+
+    while (n < budget && (buf = this->queue->dequeue()) != NULL) {
+        transmit(buf->data, buf->len);
+        tx_done(buf->rx_ns);
+        packet_put(buf);
+        n++;
+        if (this->tx_ring.pending >= this->tx_batch) {
+            flush();
+        }
+    }
+    if (this->tx_ring.pending) {
+        flush();
+    }
+    return n;
+}
+
+
+u_int64_t Port::recv_bytes()
+{
+    u_int64_t sum = 0;
+    for (int i=0; i < PORT_RX_COUNTERS; i++) {
+        sum += this->rx_counter[i].get_bytes();
+    }
+    return sum;
+}
+
+
+u_int64_t Port::recv_frames()
+{
+    u_int64_t sum = 0;
+    for (int i=0; i < PORT_RX_COUNTERS; i++) {
+        sum += this->rx_counter[i].get_frames();
+    }
+    return sum;
+}
+
+
+u_int64_t Port::sent_bytes()
+{
+    return this->tx_counter.get_bytes();
+}
+
+
+u_int64_t Port::sent_frames()
+{
+    return this->tx_counter.get_frames();
+}
+
+
+void Port::sample_rate()
+{
+    RateSample sample;
+    sample.ns = mono_ns();
+    sample.recv_f = recv_frames();
+    sample.recv_b = recv_bytes();
+    sample.send_f = sent_frames();
+    sample.send_b = sent_bytes();
+    this->rate.sample(sample);
 }
 
 
 void Port::print_stat()
 {
-    printf("%s\t%d\t%d\t%d\t%d\n", this->name.c_str(), this->send_b, this->send_f, this->recv_b, this->recv_f);
+    double recv_pps, recv_bps, send_pps, send_bps;
+    this->rate.get(&recv_pps, &recv_bps, &send_pps, &send_bps);
+    printf("%s\t%llu\t%llu\t%llu\t%llu\t%zu/%zu\t%zu\t%zu\t%.0f/%.0f\t%.0f/%.0f\n", this->name.c_str(),
+           (unsigned long long) sent_bytes(), (unsigned long long) sent_frames(),
+           (unsigned long long) recv_bytes(), (unsigned long long) recv_frames(),
+           this->queue->depth(), this->queue->max_depth, this->queue->drops,
+           __atomic_load_n(&(this->tx_drops), __ATOMIC_RELAXED),
+           send_pps, send_bps, recv_pps, recv_bps);
 }
 
 
 void Port::stop()
 {
-    assert(this->descriptor);
-    pcap_breakloop(this->descriptor);
+    this->stopped = 1;
+    if (this->descriptor) {
+        pcap_breakloop(this->descriptor);
+    }
+    this->queue->wakeup();
 }
 
 
 bool Port::operator==(const Port &second) const
 {
-    return (second.descriptor == this->descriptor);
+    return (&second == this);
 }
 
 
@@ -88,4 +567,3 @@ bool Port::operator!=(const Port &second) const
 {
     return !(*this == second);
 }
-
@@ -3,29 +3,110 @@
 
 #include <iostream>
 #include <pcap.h>
+#include "ring.h"
+#include "queue.h"
+#include "pool.h"
+#include "counters.h"
+#include "histogram.h"
 
+#define PORT_BACKEND_PCAP   0   // libpcap (pcap_loop + pcap_inject)
+#define PORT_BACKEND_RING   1   // AF_PACKET TPACKET_V3 mmap ring
+#define PORT_BACKEND_FILE   2   // trace replay (frames read from pcap file, sent frames dumped to pcap file)
+#define PORT_BACKEND_VIRTUAL 3  // in-memory port, frames are injected by caller, sent frames go to memory ring
 
+#define PORT_RX_COUNTERS    8   // max receiving threads of one port (one counter each)
+#define PORT_DEF_RX_WORKERS 1   // receiving threads of one port (ring backend only)
+
+#define VPORT_RING_FRAMES   256 // slots of virtual port transmit ring (power of two)
+
+
+class PortConfig {
+    public:
+        int backend;
+        unsigned int ring_block_size;
+        unsigned int ring_block_nr;
+        unsigned int ring_frame_size;
+        unsigned int ring_timeout;   // block retire timeout in ms
+        unsigned int tx_batch;       // flush transmit ring when this many frames are queued
+        unsigned int tx_flush_us;    // max time a queued frame waits for flush
+        unsigned int queue_len;      // egress queue length in frames (power of two)
+        unsigned int rx_workers;     // receive rings (and threads) of the port sharing the interface by PACKET_FANOUT
+        unsigned int busy_poll_us;   // low latency mode: frames are polled one by one in busy loop, SO_BUSY_POLL
+                                     // time in us (0 = blocking receive of whole ring blocks)
+        int replay_paced;            // file backend: keep time gaps of the trace instead of replaying at full speed
+
+        PortConfig();
+};
+
+
+// Frames for the port are put to its egress queue by any port thread and
+// transmitted by the dedicated TX worker of the port (tx_loop()), which is
+// the only one touching the transmit side and the send_* counters.
 class Port {
     private:
-        pthread_mutex_t mutex;
+        unsigned int tx_batch;
+        u_int64_t tx_flush_ns;
+
+        pcap_t *dump_descriptor;
+        pcap_dumper_t *dumper;
+        u_int8_t *vring;            // virtual port transmit ring
+        unsigned int vring_frame;   // slot size
+        unsigned int vring_pos;
+        u_int64_t tx_rx_ns[TX_RING_FRAMES];    // receive times of frames waiting in transmit ring (histograms on)
+        unsigned int tx_rx_count;
+
+        int open_pcap(const char *name);
+        int open_pcap_immediate(const char *name);
+        int open_rings(const char *name, const PortConfig &config);
+        void transmit(const void *buf, size_t size);
+        void flush();
+        void tx_done(u_int64_t rx_ns);
 
     public:
         Port();
-        Port(const char *name);
+        Port(const char *name, const PortConfig &config);
         ~Port();
         std::string name;
-        size_t send_b;
-        size_t send_f;
-        size_t recv_b;
-        size_t recv_f;
+        unsigned int index; // position in the switch port list
+        int backend;        // PORT_BACKEND_* actually used
+        volatile int stopped;
+        PortCounter rx_counter[PORT_RX_COUNTERS];   // one per receiving thread
+        PortCounter tx_counter;                     // written by the TX worker
+        size_t tx_drops;                            // frames the kernel refused to send, written by the TX worker
+        LatencyHistogram forward_hist;              // kernel receive to transmit done, written by the TX worker
+        LatencyHistogram tx_call_hist;              // send()/sendmmsg()/pcap_inject() time, written by the TX worker
+        RateMeter rate;
         pcap_t *descriptor;
+        unsigned int rx_workers;                    // receiving threads, each has own ring and counter
+        unsigned int busy_poll_us;                  // low latency mode (see PortConfig)
+        RxRing rx_ring[PORT_RX_COUNTERS];
+        TxRing tx_ring;
+        EgressQueue *queue;
+        int replay_paced;
+        u_int64_t replay_first_ns;  // timestamp of first frame of the input trace
+        u_int64_t replay_base_ns;   // trace time replayed at replay_start_ns (same for all ports)
+        u_int64_t replay_start_ns;
+        int numa_node;              // NUMA node of the interface, -1 if unknown
+        int fast_leave;             // IGMP leave / MLD done prunes the port at once (single host behind the port)
 
-        int send(const void *buf, size_t size); // lock + refresh values + send + unlock
+        int open_files(const char *in_file, const char *out_file); // file backend, -1 on error
+        int send(PacketBuf *buf);               // put frame to egress queue (takes own reference), -1 if dropped
+        unsigned int send_burst(PacketBuf **bufs, unsigned int n); // put frames to egress queue at once, returns number of queued frames
+        void tx_loop();                         // TX worker, returns after stop() when queue is drained
+        unsigned int tx_poll(unsigned int budget); // event engine: transmit max budget queued frames and flush, returns number of frames
+        u_int64_t recv_bytes();
+        u_int64_t recv_frames();
+        u_int64_t sent_bytes();
+        u_int64_t sent_frames();
+        void sample_rate();     // add current counters to the rate window
         void print_stat();
         void stop();
         bool operator==(const Port &) const;
         bool operator!=(const Port &) const;
 };
 
-#endif /* __SWITCH_PORT_H__ */
 
+// Warns if the interface receives frames bigger than max_frame (MTU, GRO/LRO)
+void check_frame_size(const char *ifname, unsigned int max_frame);
+
+#endif /* __SWITCH_PORT_H__ */
@@ -1,62 +1,497 @@
 #include <pcap.h>
+#include <time.h>
+#include <poll.h>
+#include <sched.h>
 #include <linux/if_ether.h>
+#include <linux/if_packet.h>
 #include "port_thread.h"
 #include "camtable.h"
 #include "igmp.h"
+#include "mld.h"
+#include "aging.h"
+#include "rcu.h"
+
+#define RING_POLL_TIMEOUT   100  // ms, how often the ring loop checks for stop request
+#define BUSY_SPIN_US        50   // low latency mode: idle port is polled in tight loop this long,
+#define BUSY_YIELD_US       2000 // then the loop yields CPU between polls until this idle time, then sleeps in poll()
+
+using namespace std;
 
 
 void handler(u_char *args, const struct pcap_pkthdr *header, const u_char *packet)
 {
     PortThreadData *tdata = (PortThreadData *) args;
-    tdata->port->recv_b += header->len;
-    tdata->port->recv_f++;
-
-    struct ethhdr *frame_hdr;
-    frame_hdr = (struct ethhdr *) packet;
-    MacAddress src_mac(frame_hdr->h_source);
-    MacAddress dest_mac(frame_hdr->h_dest);
-    
-    // Update CAM table (update age of record or add if new) by source address on the port
-    tdata->camtable->update(src_mac, tdata->port);
-    
-    if (dest_mac.is_broadcast()) {
-        // Broadcast - Send out via all ports except incoming
-        tdata->camtable->broadcast(tdata->port, packet, header->caplen);
-
-    } else if (dest_mac.is_multicast()) {
-        // Multicast - Send out via right port
-        if (tdata->igmptable->process_multicast_packet(tdata->port, packet, header->caplen) == MULT_BROADCAST) {
-            // Send packet via all interfaces except the incoming interface
-            tdata->camtable->broadcast(tdata->port, packet, header->caplen);
-        }
-        
-    } else {
-        // Unicast - Send packet out via right port
-        CamRecord *rec;
-        if ((rec = tdata->camtable->get_record(dest_mac)) != NULL) {
-			// Send to target host
-            if (rec->port != tdata->port) {
-				//But only if destination and source MAC are different
-                rec->port->send(packet, header->caplen);
+    tdata->rx_counter->add(header->len, 1);
+
+    if (header->caplen < ETH_HLEN) {
+        // Runt frame
+        return;
+    }
+
+    // One copy of the frame is shared by all egress queues it goes to
+    PacketBuf *buf = tdata->pool->alloc(packet, header->caplen);
+    if (!buf) {
+        // Pool exhausted - drop
+        return;
+    }
+    if (tdata->port->backend == PORT_BACKEND_RING || tdata->port->backend == PORT_BACKEND_PCAP) {
+        // Trace and injected frames have no receive time
+        buf->rx_ns = (u_int64_t) header->ts.tv_sec * 1000000000ULL + header->ts.tv_usec * 1000ULL;
+    } else if (tdata->port->backend == PORT_BACKEND_FILE && hist_on()) {
+        // Replayed frame is received now (for the forwarding histogram)
+        buf->rx_ns = real_ns();
+    }
+
+    tdata->frames[tdata->burst_len] = buf->data;
+    tdata->burst[tdata->burst_len++] = buf;
+    if (tdata->burst_len == BURST_SIZE) {
+        process_burst(tdata);
+    }
+}
+
+
+// Queue frame to all ports except the incoming one
+static void flood(PortThreadData *tdata, PacketBuf *buf)
+{
+    for (size_t i=0; i < tdata->ports->size(); i++) {
+        if ((*tdata->ports)[i] != tdata->port) {
+            tdata->egress[i].push_back(buf);
+        }
+    }
+}
+
+
+// Queue frame to ports in bitmap except the incoming one
+static void forward_ports(PortThreadData *tdata, PacketBuf *buf, u_int64_t ports)
+{
+    if (tdata->port->index < 64) {
+        ports &= ~(1ULL << tdata->port->index);
+    }
+    while (ports) {
+        tdata->egress[__builtin_ctzll(ports)].push_back(buf);
+        ports &= ports - 1;
+    }
+}
+
+
+// Forwarding cache lookup, with histograms on every lookup (hit or CAM
+// read on miss) is timed on its own
+static inline FwdCacheEntry *cam_lookup(PortThreadData *tdata, u_int64_t key, bool timed)
+{
+    if (!timed) {
+        return tdata->fwd_cache.lookup(tdata->camtable, key);
+    }
+    u_int64_t start = mono_ns();
+    FwdCacheEntry *entry = tdata->fwd_cache.lookup(tdata->camtable, key);
+    tdata->cam_hist.record(mono_ns() - start);
+    return entry;
+}
+
+
+// Forward all frames of the burst. Headers are classified and CAM buckets
+// of addresses missing in the forwarding cache prefetched first, then the
+// sources are checked (new, moved or stale ones go to the learner),
+// destinations looked up and at last every egress port gets all its
+// frames at once.
+void process_burst(PortThreadData *tdata)
+{
+    unsigned int n = tdata->burst_len;
+    PacketBuf **burst = tdata->burst;
+    BurstInfo *info = &(tdata->info);
+    u_int64_t *dest_keys = info->dst_key;
+    u_int64_t *src_keys = info->src_key;
+
+    if (n == 0) {
+        // Idle loops (ring timeout, empty dispatch) report quiescent state
+        // too, otherwise an idle port holds back reclamation forever
+        rcu_quiescent();
+        return;
+    }
+
+    FwdCache *cache = &(tdata->fwd_cache);
+    cache->sync(tdata->camtable);
+
+    classify_burst(tdata->frames, n, info);
+    for (unsigned int i=0; i < n; i++) {
+        if (!cache->contains(dest_keys[i])) {
+            tdata->camtable->prefetch(dest_keys[i]);
+        }
+        if (!cache->contains(src_keys[i])) {
+            tdata->camtable->prefetch(src_keys[i]);
+        }
+    }
+
+    // New, moved or stale source addresses go to the learner (CAM is read only here)
+    bool timed = hist_on();
+    u_int32_t now = coarse_time();
+    for (unsigned int i=0; i < n; i++) {
+        if (i == 0 || src_keys[i] != src_keys[i-1]) {
+            FwdCacheEntry *src = cam_lookup(tdata, src_keys[i], timed);
+            if (!src || src->port != tdata->port || (int32_t) (now - src->last_used) >= CAM_REFRESH_INTERVAL) {
+                tdata->learner->post(src_keys[i], tdata->port);
+                // Cache the record the learner is going to write, so next
+                // frames of the source don't post it again meanwhile
+                FwdCacheEntry *pending = cache->slot(src_keys[i]);
+                pending->key = src_keys[i];
+                pending->port = tdata->port;
+                pending->last_used = now;
             }
+        }
+    }
+
+    // Ports are copied out, a later miss of the burst may reuse the cache slot
+    Port *dests[BURST_SIZE];
+    for (unsigned int i=0; i < n; i++) {
+        if (info->cls[i] == FRAME_UNICAST) {
+            FwdCacheEntry *dest = cam_lookup(tdata, dest_keys[i], timed);
+            dests[i] = dest ? dest->port : NULL;
+        }
+    }
+
+    for (unsigned int i=0; i < n; i++) {
+        if (info->cls[i] == FRAME_BROADCAST) {
+            // Broadcast - Send out via all ports except incoming
+            flood(tdata, burst[i]);
+
+        } else if (info->cls[i] == FRAME_MULTICAST || info->cls[i] == FRAME_MULTICAST6) {
+            // Multicast - Send out via right port
+            u_int64_t ports;
+            int ret;
+            if (info->cls[i] == FRAME_MULTICAST) {
+                ret = tdata->igmptable->process_multicast_packet(tdata->port, burst[i], &ports);
+            } else {
+                ret = tdata->mldtable->process_multicast_packet(tdata->port, burst[i], &ports);
+            }
+            if (ret == MULT_BROADCAST) {
+                // Send packet via all interfaces except the incoming interface
+                flood(tdata, burst[i]);
+            } else if (ret == MULT_OK) {
+                forward_ports(tdata, burst[i], ports);
+            }
+
         } else {
-			// Unknown destination MAC
-            tdata->camtable->broadcast(tdata->port, packet, header->caplen);
+            // Unicast - Send packet out via right port
+            Port *dest_port = dests[i];
+            if (dest_port != NULL) {
+                // Send to target host
+                if (dest_port != tdata->port) {
+                    //But only if destination and source MAC are different
+                    tdata->egress[dest_port->index].push_back(burst[i]);
+                }
+            } else {
+                // Unknown destination MAC
+                flood(tdata, burst[i]);
+            }
         }
     }
+
+    // One enqueue per egress port
+    for (size_t i=0; i < tdata->egress.size(); i++) {
+        if (!tdata->egress[i].empty()) {
+            (*tdata->ports)[i]->send_burst(&(tdata->egress[i][0]), tdata->egress[i].size());
+            tdata->egress[i].clear();
+        }
+    }
+
+    for (unsigned int i=0; i < n; i++) {
+        packet_put(burst[i]);
+    }
+    tdata->burst_len = 0;
+
+    // No references to multicast snapshots are held between bursts
+    rcu_quiescent();
 }
 
 
-void *port_thread(void *arg)
+// Frames of one filled block of TPACKET_V3 ring, block is returned to the
+// kernel when the burst was copied out. Returns number of frames in block.
+static unsigned int ring_block(PortThreadData *tdata, RxRing *ring, struct tpacket_block_desc *block)
+{
+    struct pcap_pkthdr header;
+    struct tpacket3_hdr *frame;
+    unsigned int count = block->hdr.bh1.num_pkts;
+
+    frame = (struct tpacket3_hdr *) ((u_int8_t *) block + block->hdr.bh1.offset_to_first_pkt);
+    for (unsigned int i=0; i < count; i++) {
+        struct sockaddr_ll *sll = (struct sockaddr_ll *) ((u_int8_t *) frame + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+        if (sll->sll_pkttype != PACKET_OUTGOING) {
+            header.ts.tv_sec = frame->tp_sec;
+            header.ts.tv_usec = frame->tp_nsec / 1000;
+            header.caplen = frame->tp_snaplen;
+            header.len = frame->tp_len;
+            handler((u_char *) tdata, &header, (u_int8_t *) frame + frame->tp_mac);
+        }
+        frame = (struct tpacket3_hdr *) ((u_int8_t *) frame + frame->tp_next_offset);
+    }
+
+    ring->release_block(block);
+    process_burst(tdata);
+    return count;
+}
+
+
+// Frames waiting in TPACKET_V2 ring (at most one burst), every frame is
+// taken as soon as the kernel has written it. Returns number of frames.
+static unsigned int ring_frames(PortThreadData *tdata, RxRing *ring)
+{
+    struct pcap_pkthdr header;
+    struct tpacket2_hdr *frame;
+    unsigned int n = 0;
+
+    while (n < BURST_SIZE && (frame = ring->next_frame()) != NULL) {
+        struct sockaddr_ll *sll = (struct sockaddr_ll *) ((u_int8_t *) frame + TPACKET_ALIGN(sizeof(struct tpacket2_hdr)));
+        if (sll->sll_pkttype != PACKET_OUTGOING) {
+            header.ts.tv_sec = frame->tp_sec;
+            header.ts.tv_usec = frame->tp_nsec / 1000;
+            header.caplen = frame->tp_snaplen;
+            header.len = frame->tp_len;
+            handler((u_char *) tdata, &header, (u_int8_t *) frame + frame->tp_mac);
+        }
+        // Frame was copied to packet buffer
+        ring->release_frame(frame);
+        n++;
+    }
+
+    if (n) {
+        process_burst(tdata);
+    }
+    return n;
+}
+
+
+// Receive loop of the mmap ring backend - frames are taken directly from
+// the ring
+static void ring_loop(PortThreadData *tdata)
+{
+    RxRing *ring = &(tdata->port->rx_ring[tdata->worker]);
+
+    while (!tdata->port->stopped) {
+        struct tpacket_block_desc *block = ring->next_block(RING_POLL_TIMEOUT);
+        if (block) {
+            ring_block(tdata, ring, block);
+        } else {
+            rcu_quiescent();
+        }
+    }
+}
+
+
+// Adaptive back-off of the low latency receive loops. Short gaps between
+// frames are bridged by spinning (no wakeup latency), longer idle time by
+// yielding the CPU, an idle port at last sleeps in poll() of fd (with
+// SO_BUSY_POLL the kernel polls the device before it sleeps).
+// idle_ns is the start of the idle period, 0 when frames were received.
+static void idle_backoff(int fd, u_int64_t *idle_ns)
+{
+    rcu_quiescent();
+    u_int64_t now = mono_ns();
+    if (*idle_ns == 0) {
+        *idle_ns = now;
+    }
+
+    u_int64_t idle = now - *idle_ns;
+    if (idle < BUSY_SPIN_US * 1000ULL) {
+        cpu_relax();
+    } else if (idle < BUSY_YIELD_US * 1000ULL || fd < 0) {
+        sched_yield();
+    } else {
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN | POLLERR;
+        pfd.revents = 0;
+        poll(&pfd, 1, RING_POLL_TIMEOUT);
+    }
+}
+
+
+// Low latency receive loop of the mmap ring backend (TPACKET_V2), burst is
+// whatever arrived since the last poll
+static void frame_loop(PortThreadData *tdata)
+{
+    RxRing *ring = &(tdata->port->rx_ring[tdata->worker]);
+    u_int64_t idle_ns = 0;
+
+    while (!tdata->port->stopped) {
+        if (ring_frames(tdata, ring)) {
+            idle_ns = 0;
+        } else {
+            idle_backoff(ring->fd, &idle_ns);
+        }
+    }
+}
+
+
+// Next frame of the input trace of a file port, 0 at the end of the trace
+static int replay_next(PortThreadData *tdata, struct pcap_pkthdr **header, const u_char **packet)
+{
+    int ret = pcap_next_ex(tdata->port->descriptor, header, packet);
+    if (ret != 1) {
+        if (ret == -1) {
+            fprintf(stderr, "pcap_next_ex() error: %s\n", pcap_geterr(tdata->port->descriptor));
+        }
+        // End of trace
+        return 0;
+    }
+    return 1;
+}
+
+
+// Replay of the input trace of a file port. Returns at the end of the trace.
+// Paced replay keeps the gaps between frame timestamps, otherwise the
+// frames are processed as fast as possible.
+static void replay_loop(PortThreadData *tdata)
+{
+    struct pcap_pkthdr *header;
+    const u_char *packet;
+
+    while (!tdata->port->stopped && replay_next(tdata, &header, &packet)) {
+        if (tdata->port->replay_paced) {
+            Port *port = tdata->port;
+            u_int64_t ts = (u_int64_t) header->ts.tv_sec * 1000000000ULL + header->ts.tv_usec * 1000ULL;
+            u_int64_t due = port->replay_start_ns + (ts > port->replay_base_ns ? ts - port->replay_base_ns : 0);
+            u_int64_t now = mono_ns();
+            if (due > now) {
+                // Don't hold already received frames while waiting
+                process_burst(tdata);
+                struct timespec delay;
+                delay.tv_sec = (due - now) / 1000000000ULL;
+                delay.tv_nsec = (due - now) % 1000000000ULL;
+                nanosleep(&delay, NULL);
+            }
+        }
+
+        handler((u_char *) tdata, header, packet);
+    }
+
+    process_burst(tdata);
+}
+
+
+// Receive loop of the pcap backend. In low latency mode the descriptor is
+// non-blocking and empty reads go through the adaptive back-off.
+static void dispatch_loop(PortThreadData *tdata)
 {
     int ret;
+    int fd = tdata->port->busy_poll_us ? pcap_get_selectable_fd(tdata->port->descriptor) : -1;
+    u_int64_t idle_ns = 0;
+
+    while (!tdata->port->stopped) {
+        ret = pcap_dispatch(tdata->port->descriptor, BURST_SIZE, handler, (u_char *) tdata);
+        if (ret == -1) {
+            fprintf(stderr, "pcap_dispatch() error: %s\n", pcap_geterr(tdata->port->descriptor));
+            break;
+        }
+        if (ret == -2) {
+            // pcap_breakloop()
+            break;
+        }
+        if (ret == 0 && tdata->port->busy_poll_us) {
+            idle_backoff(fd, &idle_ns);
+            continue;
+        }
+        idle_ns = 0;
+        process_burst(tdata);
+    }
+}
+
+
+void port_thread_init(PortThreadData *tdata)
+{
+    tdata->burst_len = 0;
+    tdata->egress.resize(tdata->ports->size());
+    for (size_t i=0; i < tdata->egress.size(); i++) {
+        tdata->egress[i].reserve(BURST_SIZE);
+    }
+}
+
+
+int port_poll_fd(PortThreadData *tdata)
+{
+    Port *port = tdata->port;
+    if (port->backend == PORT_BACKEND_RING) {
+        return port->rx_ring[tdata->worker].fd;
+    }
+    if (port->backend == PORT_BACKEND_PCAP) {
+        return pcap_get_selectable_fd(port->descriptor);
+    }
+    return -1;
+}
+
+
+int port_poll(PortThreadData *tdata, unsigned int budget)
+{
+    Port *port = tdata->port;
+    int frames = 0;
+
+    if (port->backend == PORT_BACKEND_RING) {
+        RxRing *ring = &(port->rx_ring[tdata->worker]);
+        for (unsigned int i=0; i < budget; i++) {
+            unsigned int n;
+            if (ring->version == TPACKET_V2) {
+                n = ring_frames(tdata, ring);
+            } else {
+                struct tpacket_block_desc *block = ring->next_block(0);
+                n = block ? ring_block(tdata, ring, block) : 0;
+            }
+            if (!n) {
+                break;
+            }
+            frames += n;
+        }
+
+    } else if (port->backend == PORT_BACKEND_FILE) {
+        struct pcap_pkthdr *header;
+        const u_char *packet;
+        for (unsigned int i=0; i < budget * BURST_SIZE; i++) {
+            if (!replay_next(tdata, &header, &packet)) {
+                process_burst(tdata);
+                return -1;
+            }
+            handler((u_char *) tdata, header, packet);
+            frames++;
+        }
+        process_burst(tdata);
+
+    } else if (port->backend == PORT_BACKEND_PCAP) {
+        frames = pcap_dispatch(port->descriptor, budget * BURST_SIZE, handler, (u_char *) tdata);
+        if (frames < 0) {
+            if (frames == -1) {
+                fprintf(stderr, "pcap_dispatch() error: %s\n", pcap_geterr(port->descriptor));
+            }
+            frames = 0;
+        }
+        process_burst(tdata);
+    }
+
+    return frames;
+}
+
+
+void *port_thread(void *arg)
+{
     PortThreadData *tdata = (PortThreadData *) arg;
 
-    ret = pcap_loop(tdata->port->descriptor, -1, handler, (u_char *) tdata);
-    if (ret == -1) {
-        fprintf(stderr, "pcap_loop() error");
+    rcu_register();
+    port_thread_init(tdata);
+
+    if (tdata->port->backend == PORT_BACKEND_RING && tdata->port->rx_ring[tdata->worker].version == TPACKET_V2) {
+        frame_loop(tdata);
+    } else if (tdata->port->backend == PORT_BACKEND_RING) {
+        ring_loop(tdata);
+    } else if (tdata->port->backend == PORT_BACKEND_FILE) {
+        replay_loop(tdata);
+    } else {
+        dispatch_loop(tdata);
     }
 
+    rcu_unregister();
     return NULL;
 }
 
+
+void *port_tx_thread(void *arg)
+{
+    Port *port = (Port *) arg;
+    port->tx_loop();
+    return NULL;
+}
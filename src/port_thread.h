@@ -1,21 +1,47 @@
 #ifndef __SWITCH_PORT_THREAD_H__
 #define __SWITCH_PORT_THREAD_H__
 
+#include <vector>
 #include "port.h"
 #include "camtable.h"
 #include "igmp.h"
+#include "mld.h"
+#include "learner.h"
+#include "classify.h"
 
 
 class PortThreadData {
     public:
         CamTable *camtable;
         IgmpTable *igmptable;
+        MldTable *mldtable;
+        Learner *learner;
         Port *port;
+        PacketPool *pool;
+        unsigned int worker;                             // index of this receiving thread in port
+        int cpu;                                         // CPU the thread is bound to, -1 = not bound
+        PortCounter *rx_counter;                         // receive counter of this thread in port
+        std::vector<Port*> *ports;                       // all switch ports
+        PacketBuf *burst[BURST_SIZE];                    // received frames waiting for processing
+        const u_int8_t *frames[BURST_SIZE];              // their data
+        BurstInfo info;
+        FwdCache fwd_cache;                              // CAM records used by this thread
+        LatencyHistogram cam_hist;                       // every source and destination lookup (histograms on)
+        unsigned int burst_len;
+        std::vector<std::vector<PacketBuf*> > egress;    // frames of current burst for port on same index
 };
 
 
+void handler(u_char *args, const struct pcap_pkthdr *header, const u_char *packet); // add frame to burst
+void process_burst(PortThreadData *tdata);
+void port_thread_init(PortThreadData *tdata);                   // called by thread serving the receive ring
+// Event engine: receive frames waiting on the ring of tdata (max budget
+// blocks or bursts) without blocking. Returns number of frames, -1 at the
+// end of input trace.
+int port_poll(PortThreadData *tdata, unsigned int budget);
+int port_poll_fd(PortThreadData *tdata);                        // fd signalling received frames, -1 if none (file)
 void *port_thread(void *arg);
+void *port_tx_thread(void *arg);  // arg is Port*
 
 
 #endif /* __SWITCH_PORT_THREAD_H__ */
-
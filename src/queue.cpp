@@ -0,0 +1,257 @@
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "queue.h"
+
+
+PtrQueue::PtrQueue(unsigned int len)
+{
+    this->mask = len - 1;
+    if (posix_memalign((void **) &(this->cells), 64, sizeof(PtrCell) * len)) {
+        throw std::bad_alloc();
+    }
+    for (u_int64_t i=0; i < len; i++) {
+        this->cells[i].seq = i;
+        this->cells[i].ptr = NULL;
+    }
+    this->enqueue_pos = 0;
+    this->dequeue_pos = 0;
+}
+
+
+PtrQueue::~PtrQueue()
+{
+    free(this->cells);
+}
+
+
+int PtrQueue::enqueue(void *ptr)
+{
+    PtrCell *cell;
+    u_int64_t pos = __atomic_load_n(&(this->enqueue_pos), __ATOMIC_RELAXED);
+
+    while (1) {
+        cell = &(this->cells[pos & this->mask]);
+        u_int64_t seq = __atomic_load_n(&(cell->seq), __ATOMIC_ACQUIRE);
+        int64_t dif = (int64_t) seq - (int64_t) pos;
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&(this->enqueue_pos), &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) {
+            // Full
+            return -1;
+        } else {
+            pos = __atomic_load_n(&(this->enqueue_pos), __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->ptr = ptr;
+    __atomic_store_n(&(cell->seq), pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+// Reserves as many consecutive free cells as possible (at most n) with
+// a single CAS on enqueue_pos and fills them in order
+unsigned int PtrQueue::enqueue_bulk(void **ptrs, unsigned int n)
+{
+    unsigned int k;
+    u_int64_t pos = __atomic_load_n(&(this->enqueue_pos), __ATOMIC_RELAXED);
+
+    while (1) {
+        for (k=0; k < n; k++) {
+            PtrCell *cell = &(this->cells[(pos + k) & this->mask]);
+            if (__atomic_load_n(&(cell->seq), __ATOMIC_ACQUIRE) != pos + k) {
+                break;
+            }
+        }
+        if (k == 0) {
+            u_int64_t seq = __atomic_load_n(&(this->cells[pos & this->mask].seq), __ATOMIC_ACQUIRE);
+            if ((int64_t) seq - (int64_t) pos < 0) {
+                // Full
+                return 0;
+            }
+            // Another producer moved ahead
+            pos = __atomic_load_n(&(this->enqueue_pos), __ATOMIC_RELAXED);
+            continue;
+        }
+        if (__atomic_compare_exchange_n(&(this->enqueue_pos), &pos, pos + k, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    for (unsigned int i=0; i < k; i++) {
+        PtrCell *cell = &(this->cells[(pos + i) & this->mask]);
+        cell->ptr = ptrs[i];
+        __atomic_store_n(&(cell->seq), pos + i + 1, __ATOMIC_RELEASE);
+    }
+    return k;
+}
+
+
+void *PtrQueue::dequeue()
+{
+    PtrCell *cell;
+    u_int64_t pos = __atomic_load_n(&(this->dequeue_pos), __ATOMIC_RELAXED);
+
+    while (1) {
+        cell = &(this->cells[pos & this->mask]);
+        u_int64_t seq = __atomic_load_n(&(cell->seq), __ATOMIC_ACQUIRE);
+        int64_t dif = (int64_t) seq - (int64_t) (pos + 1);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&(this->dequeue_pos), &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) {
+            // Empty
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&(this->dequeue_pos), __ATOMIC_RELAXED);
+        }
+    }
+
+    void *ptr = cell->ptr;
+    __atomic_store_n(&(cell->seq), pos + this->mask + 1, __ATOMIC_RELEASE);
+    return ptr;
+}
+
+
+size_t PtrQueue::depth()
+{
+    int64_t depth = __atomic_load_n(&(this->enqueue_pos), __ATOMIC_RELAXED)
+                    - __atomic_load_n(&(this->dequeue_pos), __ATOMIC_RELAXED);
+    return depth > 0 ? depth : 0;
+}
+
+
+
+EgressQueue::EgressQueue(unsigned int len) : queue(len)
+{
+    this->sleeping = 0;
+    this->notify_sleeping = NULL;
+    this->notify_fd = -1;
+    this->drops = 0;
+    this->max_depth = 0;
+    pthread_mutex_init(&(this->wait_mutex), NULL);
+    pthread_cond_init(&(this->wait_cond), NULL);
+}
+
+
+EgressQueue::~EgressQueue()
+{
+    pthread_cond_destroy(&(this->wait_cond));
+    pthread_mutex_destroy(&(this->wait_mutex));
+}
+
+
+int EgressQueue::enqueue(PacketBuf *buf)
+{
+    if (this->queue.enqueue(buf) < 0) {
+        // Full - tail drop
+        __atomic_fetch_add(&(this->drops), 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    wakeup();
+    return 0;
+}
+
+
+unsigned int EgressQueue::enqueue_bulk(PacketBuf **bufs, unsigned int n)
+{
+    unsigned int done = this->queue.enqueue_bulk((void **) bufs, n);
+    if (done < n) {
+        // Tail drop of what didn't fit
+        __atomic_fetch_add(&(this->drops), n - done, __ATOMIC_RELAXED);
+    }
+    if (done) {
+        wakeup();
+    }
+    return done;
+}
+
+
+PacketBuf *EgressQueue::dequeue()
+{
+    size_t cur_depth = this->queue.depth();
+    if (cur_depth > this->max_depth) {
+        this->max_depth = cur_depth;
+    }
+    return (PacketBuf *) this->queue.dequeue();
+}
+
+
+void EgressQueue::wait(u_int64_t max_ns)
+{
+    for (int i=0; i < QUEUE_SPIN; i++) {
+        if (this->queue.depth()) {
+            return;
+        }
+        cpu_relax();
+    }
+
+    if (!max_ns) {
+        max_ns = QUEUE_SLEEP_MS * 1000000ULL;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += max_ns / 1000000000ULL;
+    ts.tv_nsec += max_ns % 1000000000ULL;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&(this->wait_mutex));
+    __atomic_store_n(&(this->sleeping), 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!this->queue.depth()) {
+        pthread_cond_timedwait(&(this->wait_cond), &(this->wait_mutex), &ts);
+    }
+    __atomic_store_n(&(this->sleeping), 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&(this->wait_mutex));
+}
+
+
+void EgressQueue::wakeup()
+{
+    // Pairs with the store of sleeping flag in wait() - either the consumer
+    // sees the new frame or we see it sleeping
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int *notify_sleeping = __atomic_load_n(&(this->notify_sleeping), __ATOMIC_ACQUIRE);
+    if (notify_sleeping) {
+        if (__atomic_load_n(notify_sleeping, __ATOMIC_RELAXED)) {
+            u_int64_t one = 1;
+            ssize_t ret = write(__atomic_load_n(&(this->notify_fd), __ATOMIC_RELAXED), &one, sizeof(one));
+            (void) ret;     // eventfd fails only on counter overflow, the worker is awake then
+        }
+        return;
+    }
+    if (__atomic_load_n(&(this->sleeping), __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&(this->wait_mutex));
+        pthread_cond_signal(&(this->wait_cond));
+        pthread_mutex_unlock(&(this->wait_mutex));
+    }
+}
+
+
+// New consumer checks the queue before it sleeps (after its own fence),
+// so a frame enqueued while the old consumer was notified is not missed
+void EgressQueue::set_notify(int *sleeping, int fd)
+{
+    // fd is published together with the flag
+    __atomic_store_n(&(this->notify_fd), fd, __ATOMIC_RELAXED);
+    __atomic_store_n(&(this->notify_sleeping), sleeping, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+
+size_t EgressQueue::depth()
+{
+    return this->queue.depth();
+}
@@ -0,0 +1,82 @@
+#ifndef __SWITCH_QUEUE_H__
+#define __SWITCH_QUEUE_H__
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#define QUEUE_DEF_LEN       1024    // frames, must be power of two
+#define QUEUE_SPIN          200     // empty polls before the consumer goes to sleep
+#define QUEUE_SLEEP_MS      100     // max sleep of idle consumer
+
+
+class PacketBuf;
+
+
+// Spin wait hint (pause on x86, yield on ARM, at least a compiler barrier)
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield" ::: "memory");
+#else
+    __asm__ volatile("" ::: "memory");
+#endif
+}
+
+
+class PtrCell {
+    public:
+        u_int64_t seq;
+        void *ptr;
+};
+
+
+// Bounded lock free multi-producer multi-consumer queue of pointers
+// (algorithm by D. Vyukov). Length must be power of two.
+class PtrQueue {
+    private:
+        PtrCell *cells;
+        u_int64_t mask;
+        u_int64_t enqueue_pos __attribute__((aligned(64)));
+        u_int64_t dequeue_pos __attribute__((aligned(64)));
+
+    public:
+        PtrQueue(unsigned int len);
+        ~PtrQueue();
+        int enqueue(void *ptr);     // -1 if full
+        unsigned int enqueue_bulk(void **ptrs, unsigned int n); // returns number of enqueued pointers
+        void *dequeue();            // NULL if empty
+        size_t depth();
+} __attribute__((aligned(64)));
+
+
+// Egress queue of a port. Producers (port threads) put references to packet
+// buffers, the consumer (TX worker of the port) takes them out. Full queue
+// drops the new frame. Consumer of the event engine sleeps in epoll_wait()
+// instead of wait(), it is woken through its own flag and eventfd.
+class EgressQueue {
+    private:
+        PtrQueue queue;
+        int sleeping;
+        pthread_mutex_t wait_mutex;
+        pthread_cond_t wait_cond;
+        int *notify_sleeping;   // sleeping flag of event engine worker, NULL = TX thread
+        int notify_fd;          // eventfd of that worker
+
+    public:
+        size_t drops;       // frames dropped because the queue was full
+        size_t max_depth;   // highest occupancy seen by the consumer
+
+        EgressQueue(unsigned int len);
+        ~EgressQueue();
+        int enqueue(PacketBuf *buf);    // producer side, -1 = dropped
+        unsigned int enqueue_bulk(PacketBuf **bufs, unsigned int n); // producer side, returns number of enqueued frames, rest is dropped
+        PacketBuf *dequeue();           // consumer side, NULL if empty
+        void wait(u_int64_t max_ns = 0); // consumer side, sleep until something is enqueued (max_ns, 0 = QUEUE_SLEEP_MS)
+        void wakeup();                  // wake sleeping consumer
+        void set_notify(int *sleeping, int fd); // consumer is event engine worker (NULL = TX thread)
+        size_t depth();
+};
+
+#endif /* __SWITCH_QUEUE_H__ */
@@ -0,0 +1,112 @@
+#include <vector>
+#include <cstdio>
+#include <pthread.h>
+#include "rcu.h"
+
+using namespace std;
+
+
+class RcuRetired {
+    public:
+        void *ptr;
+        void (*free_fn)(void *);
+        u_int64_t epoch;    // global epoch when the object was unlinked
+};
+
+
+u_int64_t g_rcu_epoch = 1;
+__thread RcuThread *g_rcu_self = NULL;
+
+static RcuThread rcu_threads[RCU_MAX_THREADS];
+static pthread_mutex_t rcu_mutex = PTHREAD_MUTEX_INITIALIZER;
+static vector<RcuRetired> rcu_retired;
+
+
+void rcu_register()
+{
+    pthread_mutex_lock(&rcu_mutex);
+    for (int i=0; i < RCU_MAX_THREADS; i++) {
+        if (!rcu_threads[i].active) {
+            rcu_threads[i].epoch = __atomic_load_n(&g_rcu_epoch, __ATOMIC_SEQ_CST);
+            __atomic_store_n(&(rcu_threads[i].active), 1, __ATOMIC_RELEASE);
+            g_rcu_self = &(rcu_threads[i]);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&rcu_mutex);
+
+    if (!g_rcu_self) {
+        fprintf(stderr, "Too many RCU reader threads (max %d)\n", RCU_MAX_THREADS);
+    }
+}
+
+
+void rcu_unregister()
+{
+    if (!g_rcu_self) {
+        return;
+    }
+    pthread_mutex_lock(&rcu_mutex);
+    __atomic_store_n(&(g_rcu_self->active), 0, __ATOMIC_RELEASE);
+    g_rcu_self = NULL;
+    pthread_mutex_unlock(&rcu_mutex);
+}
+
+
+void rcu_retire(void *ptr, void (*free_fn)(void *))
+{
+    RcuRetired retired;
+    retired.ptr = ptr;
+    retired.free_fn = free_fn;
+
+    pthread_mutex_lock(&rcu_mutex);
+    // Readers which report the new epoch can't see the unlinked object
+    retired.epoch = __atomic_fetch_add(&g_rcu_epoch, 1, __ATOMIC_SEQ_CST);
+    rcu_retired.push_back(retired);
+    pthread_mutex_unlock(&rcu_mutex);
+}
+
+
+void rcu_reclaim()
+{
+    vector<RcuRetired> ready;
+
+    pthread_mutex_lock(&rcu_mutex);
+    u_int64_t min_epoch = __atomic_load_n(&g_rcu_epoch, __ATOMIC_SEQ_CST);
+    for (int i=0; i < RCU_MAX_THREADS; i++) {
+        if (__atomic_load_n(&(rcu_threads[i].active), __ATOMIC_ACQUIRE)) {
+            u_int64_t epoch = __atomic_load_n(&(rcu_threads[i].epoch), __ATOMIC_ACQUIRE);
+            if (epoch < min_epoch) {
+                min_epoch = epoch;
+            }
+        }
+    }
+
+    size_t kept = 0;
+    for (size_t i=0; i < rcu_retired.size(); i++) {
+        if (rcu_retired[i].epoch < min_epoch) {
+            ready.push_back(rcu_retired[i]);
+        } else {
+            rcu_retired[kept++] = rcu_retired[i];
+        }
+    }
+    rcu_retired.resize(kept);
+    pthread_mutex_unlock(&rcu_mutex);
+
+    for (size_t i=0; i < ready.size(); i++) {
+        ready[i].free_fn(ready[i].ptr);
+    }
+}
+
+
+void rcu_reclaim_all()
+{
+    pthread_mutex_lock(&rcu_mutex);
+    vector<RcuRetired> ready;
+    ready.swap(rcu_retired);
+    pthread_mutex_unlock(&rcu_mutex);
+
+    for (size_t i=0; i < ready.size(); i++) {
+        ready[i].free_fn(ready[i].ptr);
+    }
+}
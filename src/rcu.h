@@ -0,0 +1,41 @@
+#ifndef __SWITCH_RCU_H__
+#define __SWITCH_RCU_H__
+
+#include <sys/types.h>
+
+#define RCU_MAX_THREADS     256
+
+
+// Quiescent state based reclamation. Data plane threads read shared
+// structures without any lock and report a quiescent state (a point where
+// they hold no reference to them) once per burst and on every idle pass
+// of their receive loop. Objects unlinked by the control plane are freed
+// only after every registered thread went through a quiescent state.
+
+class RcuThread {
+    public:
+        u_int64_t epoch;    // global epoch seen in last quiescent state
+        int active;
+} __attribute__((aligned(64)));
+
+extern u_int64_t g_rcu_epoch;
+extern __thread RcuThread *g_rcu_self;
+
+
+void rcu_register();    // calling thread becomes a reader
+void rcu_unregister();
+
+// No reference to RCU protected data is held by the calling thread
+static inline void rcu_quiescent()
+{
+    if (g_rcu_self) {
+        __atomic_store_n(&(g_rcu_self->epoch), __atomic_load_n(&g_rcu_epoch, __ATOMIC_SEQ_CST), __ATOMIC_RELEASE);
+    }
+}
+
+// Free ptr with free_fn once no reader can see it (ptr has to be unlinked already)
+void rcu_retire(void *ptr, void (*free_fn)(void *));
+void rcu_reclaim();     // free what is safe, called periodically by the aging thread
+void rcu_reclaim_all(); // at exit, when there are no readers
+
+#endif /* __SWITCH_RCU_H__ */
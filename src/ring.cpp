@@ -0,0 +1,478 @@
+#include <cstdio>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include "ring.h"
+
+
+RxRing::RxRing()
+{
+    this->fd = -1;
+    this->map = NULL;
+    this->map_size = 0;
+    this->block_size = 0;
+    this->block_nr = 0;
+    this->cur_block = 0;
+    this->frame_size = 0;
+    this->frames_per_block = 0;
+    this->frame_nr = 0;
+    this->cur_frame = 0;
+    this->drops = 0;
+    this->version = TPACKET_V3;
+}
+
+
+RxRing::~RxRing()
+{
+    this->close();
+}
+
+
+int RxRing::open(const char *ifname, unsigned int block_size, unsigned int block_nr,
+                 unsigned int frame_size, unsigned int timeout, unsigned int busy_poll_us)
+{
+    int version = busy_poll_us ? TPACKET_V2 : TPACKET_V3;
+    struct tpacket_req3 req;
+    struct sockaddr_ll addr;
+    struct packet_mreq mreq;
+    unsigned int ifindex;
+
+    if ((ifindex = if_nametoindex(ifname)) == 0) {
+        fprintf(stderr, "Unknown interface %s\n", ifname);
+        return -1;
+    }
+
+    if ((this->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL))) < 0) {
+        perror("socket(AF_PACKET)");
+        return -1;
+    }
+
+    if (setsockopt(this->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+        perror("setsockopt(PACKET_VERSION)");
+        this->close();
+        return -1;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = block_size;
+    req.tp_block_nr = block_nr;
+    req.tp_frame_size = frame_size;
+    req.tp_frame_nr = (block_size / frame_size) * block_nr;
+    if (version == TPACKET_V3) {
+        req.tp_retire_blk_tov = timeout;
+    }
+    // TPACKET_V2 takes only the leading struct tpacket_req part
+    if (setsockopt(this->fd, SOL_PACKET, PACKET_RX_RING, &req,
+                   version == TPACKET_V3 ? sizeof(req) : sizeof(struct tpacket_req)) < 0) {
+        perror("setsockopt(PACKET_RX_RING)");
+        this->close();
+        return -1;
+    }
+
+    this->map_size = (size_t) block_size * block_nr;
+    this->map = (u_int8_t *) mmap(NULL, this->map_size, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_LOCKED, this->fd, 0);
+    if (this->map == MAP_FAILED) {
+        // MAP_LOCKED may fail on low RLIMIT_MEMLOCK
+        this->map = (u_int8_t *) mmap(NULL, this->map_size, PROT_READ | PROT_WRITE,
+                                      MAP_SHARED, this->fd, 0);
+    }
+    if (this->map == MAP_FAILED) {
+        perror("mmap(PACKET_RX_RING)");
+        this->map = NULL;
+        this->close();
+        return -1;
+    }
+    this->block_size = block_size;
+    this->block_nr = block_nr;
+    this->cur_block = 0;
+    this->frame_size = frame_size;
+    this->frames_per_block = block_size / frame_size;
+    this->frame_nr = req.tp_frame_nr;
+    this->cur_frame = 0;
+    this->version = version;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_ALL);
+    addr.sll_ifindex = ifindex;
+    if (bind(this->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror("bind(AF_PACKET)");
+        this->close();
+        return -1;
+    }
+
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.mr_ifindex = ifindex;
+    mreq.mr_type = PACKET_MR_PROMISC;
+    if (setsockopt(this->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+        perror("setsockopt(PACKET_ADD_MEMBERSHIP)");
+        this->close();
+        return -1;
+    }
+
+#ifdef PACKET_IGNORE_OUTGOING
+    // Same as pcap_setdirection(PCAP_D_IN), older kernels are handled by sll_pkttype check
+    int one = 1;
+    setsockopt(this->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one));
+#endif
+
+    if (busy_poll_us) {
+        // Kernel polls the device queue in poll() instead of waiting for interrupt
+        int us = busy_poll_us;
+        if (setsockopt(this->fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us)) < 0) {
+            perror("setsockopt(SO_BUSY_POLL)");
+        }
+#ifdef SO_PREFER_BUSY_POLL
+        int prefer = 1;
+        setsockopt(this->fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer));
+#endif
+    }
+
+    return 0;
+}
+
+
+struct tpacket_block_desc *RxRing::next_block(int timeout)
+{
+    struct tpacket_block_desc *block;
+    block = (struct tpacket_block_desc *) (this->map + (size_t) this->cur_block * this->block_size);
+
+    if (!(__atomic_load_n(&(block->hdr.bh1.block_status), __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+        if (timeout == 0) {
+            return NULL;
+        }
+        struct pollfd pfd;
+        pfd.fd = this->fd;
+        pfd.events = POLLIN | POLLERR;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+            perror("poll()");
+        }
+        if (!(__atomic_load_n(&(block->hdr.bh1.block_status), __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+            return NULL;
+        }
+    }
+
+    return block;
+}
+
+
+void RxRing::release_block(struct tpacket_block_desc *block)
+{
+    __atomic_store_n(&(block->hdr.bh1.block_status), TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+    this->cur_block = (this->cur_block + 1) % this->block_nr;
+}
+
+
+struct tpacket2_hdr *RxRing::next_frame()
+{
+    unsigned int block = this->cur_frame / this->frames_per_block;
+    unsigned int slot = this->cur_frame % this->frames_per_block;
+    struct tpacket2_hdr *frame;
+    frame = (struct tpacket2_hdr *) (this->map + (size_t) block * this->block_size + (size_t) slot * this->frame_size);
+
+    if (!(__atomic_load_n(&(frame->tp_status), __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+        return NULL;
+    }
+    return frame;
+}
+
+
+void RxRing::release_frame(struct tpacket2_hdr *frame)
+{
+    __atomic_store_n(&(frame->tp_status), TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+    this->cur_frame = (this->cur_frame + 1) % this->frame_nr;
+}
+
+
+void RxRing::wait(int timeout)
+{
+    struct pollfd pfd;
+    pfd.fd = this->fd;
+    pfd.events = POLLIN | POLLERR;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+        perror("poll()");
+    }
+}
+
+
+// Must be called after open() (socket is bound). Kernel spreads received
+// frames over all sockets of the group by hash of addresses and ports, so
+// frames of one flow always go to the same ring and stay in order.
+int RxRing::join_fanout(u_int16_t group)
+{
+    int arg = group | (RING_FANOUT_MODE << 16);
+    if (setsockopt(this->fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) < 0) {
+        perror("setsockopt(PACKET_FANOUT)");
+        return -1;
+    }
+    return 0;
+}
+
+
+u_int64_t RxRing::get_drops()
+{
+    struct tpacket_stats_v3 stats;
+    socklen_t len = sizeof(stats);
+
+    // Kernel resets its counters on every read
+    if (this->fd >= 0 && getsockopt(this->fd, SOL_PACKET, PACKET_STATISTICS, &stats, &len) == 0) {
+        this->drops += stats.tp_drops;
+    }
+    return this->drops;
+}
+
+
+void RxRing::close()
+{
+    if (this->map) {
+        munmap(this->map, this->map_size);
+        this->map = NULL;
+    }
+    if (this->fd >= 0) {
+        ::close(this->fd);
+        this->fd = -1;
+    }
+}
+
+
+
+TxRing::TxRing()
+{
+    this->fd = -1;
+    this->mode = TX_MODE_RING;
+    this->map = NULL;
+    this->map_size = 0;
+    this->frame_size = 0;
+    this->frame_nr = 0;
+    this->block_size = 0;
+    this->block_frames = 0;
+    this->cur_frame = 0;
+    this->msgs = NULL;
+    this->iovs = NULL;
+    this->pending = 0;
+    this->pending_bytes = 0;
+}
+
+
+TxRing::~TxRing()
+{
+    this->close();
+}
+
+
+int TxRing::open(const char *ifname, unsigned int max_frame)
+{
+    struct sockaddr_ll addr;
+    unsigned int ifindex;
+
+    if ((ifindex = if_nametoindex(ifname)) == 0) {
+        fprintf(stderr, "Unknown interface %s\n", ifname);
+        return -1;
+    }
+
+    // Protocol 0 - socket is used only for sending and receives nothing
+    if ((this->fd = socket(AF_PACKET, SOCK_RAW, 0)) < 0) {
+        perror("socket(AF_PACKET)");
+        return -1;
+    }
+
+    if (open_ring(max_frame) < 0 && open_mmsg(max_frame) < 0) {
+        this->close();
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = 0;
+    addr.sll_ifindex = ifindex;
+    if (bind(this->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror("bind(AF_PACKET)");
+        this->close();
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int TxRing::open_ring(unsigned int max_frame)
+{
+    int version = TPACKET_V2;
+    struct tpacket_req req;
+    unsigned int frame_size = TPACKET_ALIGN(TPACKET2_HDRLEN - sizeof(struct sockaddr_ll) + max_frame);
+
+    if (setsockopt(this->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+        return -1;
+    }
+
+    // One frame per page sized block keeps block size valid for any frame size
+    memset(&req, 0, sizeof(req));
+    req.tp_frame_size = frame_size;
+    req.tp_block_size = getpagesize();
+    while (req.tp_block_size < frame_size) {
+        req.tp_block_size <<= 1;
+    }
+    req.tp_frame_nr = TX_RING_FRAMES;
+    req.tp_block_nr = TX_RING_FRAMES / (req.tp_block_size / frame_size);
+    req.tp_frame_nr = req.tp_block_nr * (req.tp_block_size / frame_size);
+    if (setsockopt(this->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0) {
+        perror("setsockopt(PACKET_TX_RING)");
+        return -1;
+    }
+
+    this->map_size = (size_t) req.tp_block_size * req.tp_block_nr;
+    this->map = (u_int8_t *) mmap(NULL, this->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd, 0);
+    if (this->map == MAP_FAILED) {
+        perror("mmap(PACKET_TX_RING)");
+        this->map = NULL;
+        return -1;
+    }
+
+    this->mode = TX_MODE_RING;
+    this->frame_size = frame_size;
+    this->frame_nr = req.tp_frame_nr;
+    this->block_size = req.tp_block_size;
+    this->block_frames = req.tp_block_size / frame_size;
+    this->cur_frame = 0;
+    return 0;
+}
+
+
+int TxRing::open_mmsg(unsigned int frame_size)
+{
+    this->mode = TX_MODE_MMSG;
+    this->map_size = (size_t) frame_size * TX_RING_FRAMES;
+    this->map = (u_int8_t *) malloc(this->map_size);
+    this->msgs = (struct mmsghdr *) calloc(TX_RING_FRAMES, sizeof(struct mmsghdr));
+    this->iovs = (struct iovec *) calloc(TX_RING_FRAMES, sizeof(struct iovec));
+    if (!this->map || !this->msgs || !this->iovs) {
+        return -1;
+    }
+
+    for (unsigned int i=0; i < TX_RING_FRAMES; i++) {
+        this->iovs[i].iov_base = this->map + (size_t) i * frame_size;
+        this->msgs[i].msg_hdr.msg_iov = &(this->iovs[i]);
+        this->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    this->frame_size = frame_size;
+    this->frame_nr = TX_RING_FRAMES;
+    this->cur_frame = 0;
+    return 0;
+}
+
+
+int TxRing::queue(const void *buf, size_t size)
+{
+    if (this->mode == TX_MODE_MMSG) {
+        if (size > this->frame_size || this->pending >= this->frame_nr) {
+            return -1;
+        }
+        memcpy(this->iovs[this->pending].iov_base, buf, size);
+        this->iovs[this->pending].iov_len = size;
+        this->pending++;
+        this->pending_bytes += size;
+        return 0;
+    }
+
+    size_t data_off = TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
+    if (size > this->frame_size - data_off) {
+        return -1;
+    }
+
+    // Frames never cross block boundary
+    struct tpacket2_hdr *hdr = (struct tpacket2_hdr *) (this->map
+                               + (size_t) (this->cur_frame / this->block_frames) * this->block_size
+                               + (this->cur_frame % this->block_frames) * this->frame_size);
+    unsigned int status = __atomic_load_n(&(hdr->tp_status), __ATOMIC_ACQUIRE);
+    if (status == TP_STATUS_WRONG_FORMAT) {
+        // Frame refused by kernel, slot can be reused
+        status = TP_STATUS_AVAILABLE;
+    }
+    if (status != TP_STATUS_AVAILABLE) {
+        // Ring is full (kernel still sending)
+        return -1;
+    }
+
+    memcpy((u_int8_t *) hdr + data_off, buf, size);
+    hdr->tp_len = size;
+    __atomic_store_n(&(hdr->tp_status), TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+    this->cur_frame = (this->cur_frame + 1) % this->frame_nr;
+    this->pending++;
+    this->pending_bytes += size;
+    return 0;
+}
+
+
+int TxRing::flush(unsigned int *frames)
+{
+    int ret;
+    *frames = 0;
+
+    if (this->pending == 0) {
+        return 0;
+    }
+
+    if (this->mode == TX_MODE_MMSG) {
+        // Rest of partially sent batch is sent again, frame refused by the
+        // kernel is skipped (caller counts it as dropped)
+        size_t bytes = 0;
+        unsigned int i = 0;
+        while (i < this->pending) {
+            ret = sendmmsg(this->fd, this->msgs + i, this->pending - i, 0);
+            if (ret < 0) {
+                if (errno != EINTR) {
+                    i++;
+                }
+                continue;
+            }
+            for (int j=0; j < ret; j++) {
+                bytes += this->iovs[i + j].iov_len;
+            }
+            *frames += ret;
+            i += ret;
+        }
+        ret = bytes;
+    } else {
+        // Blocks until kernel processed all SEND_REQUEST frames, returns sent bytes
+        ret = ::send(this->fd, NULL, 0, 0);
+        if (ret >= 0) {
+            *frames = this->pending;
+        }
+    }
+
+    this->pending = 0;
+    this->pending_bytes = 0;
+    return ret;
+}
+
+
+void TxRing::close()
+{
+    if (this->map) {
+        if (this->mode == TX_MODE_MMSG) {
+            free(this->map);
+        } else {
+            munmap(this->map, this->map_size);
+        }
+        this->map = NULL;
+    }
+    free(this->msgs);
+    free(this->iovs);
+    this->msgs = NULL;
+    this->iovs = NULL;
+    if (this->fd >= 0) {
+        ::close(this->fd);
+        this->fd = -1;
+    }
+}
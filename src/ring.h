@@ -0,0 +1,93 @@
+#ifndef __SWITCH_RING_H__
+#define __SWITCH_RING_H__
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <linux/if_packet.h>
+
+
+#define RING_DEF_BLOCK_SIZE     (1 << 18)   // 256 KiB
+#define RING_DEF_BLOCK_NR       64
+#define RING_DEF_FRAME_SIZE     2048
+#define RING_DEF_TIMEOUT        10          // block retire timeout in ms
+#define RING_FANOUT_MODE        (PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG)  // frames of one flow go to same ring
+
+#define TX_RING_FRAMES          512         // frames in the transmit ring
+#define TX_DEF_BATCH            32          // queued frames which force a flush
+#define TX_DEF_FLUSH_US         0           // max time a frame waits in ring (0 = flush after every receive batch)
+
+#define TX_MODE_RING            0           // PACKET_TX_RING
+#define TX_MODE_MMSG            1           // sendmmsg() fallback
+
+
+// AF_PACKET receive ring. In TPACKET_V3 mode kernel fills whole blocks of
+// frames, user space walks a block in place and hands it back when done.
+// Block is handed over only when full or after the retire timeout, so the
+// low latency mode (busy_poll_us set) uses TPACKET_V2 ring of single frames
+// instead, every frame is visible as soon as the kernel has written it.
+class RxRing {
+    private:
+        u_int8_t *map;
+        size_t map_size;
+        unsigned int block_size;
+        unsigned int block_nr;
+        unsigned int cur_block;
+        unsigned int frame_size;        // TPACKET_V2 only
+        unsigned int frames_per_block;
+        unsigned int frame_nr;
+        unsigned int cur_frame;
+        u_int64_t drops;        // kernel drops summed over PACKET_STATISTICS reads
+
+    public:
+        int fd;
+        int version;            // TPACKET_V3 or TPACKET_V2
+
+        RxRing();
+        ~RxRing();
+        // busy_poll_us > 0 opens frame ring with SO_BUSY_POLL (low latency mode)
+        int open(const char *ifname, unsigned int block_size, unsigned int block_nr,
+                 unsigned int frame_size, unsigned int timeout, unsigned int busy_poll_us);
+        int join_fanout(u_int16_t group);   // share interface with other rings of group (flow hash), -1 on error
+        u_int64_t get_drops();              // frames dropped by kernel because ring was full
+        struct tpacket_block_desc *next_block(int timeout); // wait max timeout ms for a filled block (0 = don't wait), NULL if none
+        void release_block(struct tpacket_block_desc *block);
+        struct tpacket2_hdr *next_frame();  // TPACKET_V2, received frame or NULL (doesn't wait)
+        void release_frame(struct tpacket2_hdr *frame);
+        void wait(int timeout);             // sleep max timeout ms until something is received
+        void close();
+};
+
+
+// AF_PACKET transmit path. Frames are copied into PACKET_TX_RING slots and
+// sent by one send() per flush. If the kernel refuses TX ring, frames are
+// collected in a local buffer and sent by one sendmmsg() instead.
+class TxRing {
+    private:
+        int mode;
+        u_int8_t *map;          // TX ring or sendmmsg buffers
+        size_t map_size;
+        unsigned int frame_size;
+        unsigned int frame_nr;
+        unsigned int block_size;
+        unsigned int block_frames;  // frames in one ring block
+        unsigned int cur_frame;
+        struct mmsghdr *msgs;
+        struct iovec *iovs;
+
+        int open_ring(unsigned int max_frame);
+        int open_mmsg(unsigned int max_frame);
+
+    public:
+        int fd;
+        unsigned int pending;       // frames queued since last flush
+        size_t pending_bytes;
+
+        TxRing();
+        ~TxRing();
+        int open(const char *ifname, unsigned int max_frame);
+        int queue(const void *buf, size_t size);  // -1 if frame doesn't fit or ring is full
+        int flush(unsigned int *frames);          // returns bytes sent (or -1), number of sent frames in frames (rest is lost)
+        void close();
+};
+
+#endif /* __SWITCH_RING_H__ */